@@ -0,0 +1,119 @@
+module yar;
+import :cache;
+import std;
+import xson;
+
+yar::db::document_cache::document_cache(std::size_t capacity) :
+    m_capacity{capacity}
+{}
+
+std::pair<std::shared_ptr<const yar::db::document_cache::record>, std::size_t> yar::db::document_cache::find(std::streamoff position)
+{
+    if(!enabled())
+        return {nullptr, 0};
+
+    auto& shard = shard_of(position);
+    const auto lock = std::lock_guard{shard.mutex};
+    const auto it = shard.positions.find(position);
+    if(it == shard.positions.end())
+    {
+        ++shard.misses;
+        return {nullptr, 0};
+    }
+
+    ++shard.hits;
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    return {it->second->value, it->second->size};
+}
+
+void yar::db::document_cache::insert(std::streamoff position, yar::db::document_cache::record decoded, std::size_t size)
+{
+    if(!enabled())
+        return;
+
+    const auto charge = size + entry_overhead;
+    if(charge > m_capacity.load(std::memory_order_relaxed) >> shard_bits)
+        return;
+
+    auto value = std::make_shared<const record>(std::move(decoded));
+    auto& shard = shard_of(position);
+    const auto lock = std::lock_guard{shard.mutex};
+
+    // Readers racing for the same record decode it once each, the first one is kept
+    if(shard.positions.contains(position))
+        return;
+
+    shard.entries.push_front({position, std::move(value), size, charge});
+    shard.positions.emplace(position, shard.entries.begin());
+    shard.bytes += charge;
+    evict(shard);
+}
+
+void yar::db::document_cache::erase(std::streamoff position)
+{
+    auto& shard = shard_of(position);
+    const auto lock = std::lock_guard{shard.mutex};
+    const auto it = shard.positions.find(position);
+    if(it == shard.positions.end())
+        return;
+    shard.bytes -= it->second->charge;
+    shard.entries.erase(it->second);
+    shard.positions.erase(it);
+}
+
+void yar::db::document_cache::clear()
+{
+    for(auto& shard : m_shards)
+    {
+        const auto lock = std::lock_guard{shard.mutex};
+        shard.entries.clear();
+        shard.positions.clear();
+        shard.bytes = 0;
+    }
+}
+
+void yar::db::document_cache::resize(std::size_t capacity)
+{
+    m_capacity.store(capacity, std::memory_order_relaxed);
+    for(auto& shard : m_shards)
+    {
+        const auto lock = std::lock_guard{shard.mutex};
+        evict(shard);
+    }
+}
+
+yar::db::cache_statistics yar::db::document_cache::statistics() const
+{
+    auto result = yar::db::cache_statistics{};
+    result.capacity = m_capacity.load(std::memory_order_relaxed);
+    for(const auto& shard : m_shards)
+    {
+        const auto lock = std::lock_guard{shard.mutex};
+        result.hits += shard.hits;
+        result.misses += shard.misses;
+        result.evictions += shard.evictions;
+        result.entries += shard.entries.size();
+        result.bytes += shard.bytes;
+    }
+    return result;
+}
+
+yar::db::document_cache::shard& yar::db::document_cache::shard_of(std::streamoff position)
+{
+    // Fibonacci hashing spreads neighbouring positions over the shards
+    const auto hash = static_cast<std::uint64_t>(position) * 0x9e3779b97f4a7c15ull;
+    return m_shards[hash >> (64 - shard_bits)];
+}
+
+void yar::db::document_cache::evict(yar::db::document_cache::shard& shard)
+{
+    const auto capacity = m_capacity.load(std::memory_order_relaxed) >> shard_bits;
+    while(shard.bytes > capacity && !shard.entries.empty())
+    {
+        const auto& victim = shard.entries.back();
+        shard.bytes -= victim.charge;
+        shard.positions.erase(victim.position);
+        shard.entries.pop_back();
+        ++shard.evictions;
+    }
+}
@@ -0,0 +1,122 @@
+module;
+#include <fcntl.h>
+#include <unistd.h>
+module yar;
+import :checkpoint;
+import :index;
+import std;
+import xson;
+
+namespace {
+
+using namespace std::string_literals;
+
+// Version 2 keys documents missing trailing fields of a compound index, version 1 files are rebuilt
+constexpr auto magic = std::string_view{"YARDBIX2"};
+
+// fsync a file, or a directory to make a rename in it durable
+bool sync_file(const std::string& file)
+{
+    const auto descriptor = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if(descriptor < 0)
+        return false;
+    const auto synced = ::fsync(descriptor) == 0;
+    ::close(descriptor);
+    return synced;
+}
+
+// FNV-1a, enough to tell a torn or corrupted checkpoint from a good one
+auto checksum(std::string_view bytes)
+{
+    auto hash = std::uint64_t{14695981039346656037ull};
+    for(const auto c : bytes)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+} // namespace
+
+std::string yar::db::checkpoint::encode(const yar::db::collection_indexes& indexes)
+{
+    auto os = std::ostringstream{};
+    xson::fast::encode(os, static_cast<std::int64_t>(indexes.size()));
+    for(const auto& [collection, index] : indexes)
+    {
+        xson::fast::encode(os, collection);
+        index.save(os);
+    }
+    return std::move(os).str();
+}
+
+bool yar::db::checkpoint::save(const std::string& file, std::string_view indexes) const
+{
+    auto os = std::ostringstream{};
+    xson::fast::encode(os, static_cast<std::int64_t>(offset));
+    xson::fast::encode(os, static_cast<std::int64_t>(last));
+    xson::fast::encode(os, timestamp);
+    os << indexes;
+    const auto payload = std::move(os).str();
+    const auto hash = checksum(payload);
+
+    const auto temporary = file + ".tmp"s;
+    {
+        auto out = std::ofstream{temporary, std::ios::binary | std::ios::trunc};
+        out.write(magic.data(), static_cast<std::streamsize>(magic.size()));
+        out.write(reinterpret_cast<const char*>(&hash), sizeof hash);
+        out.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+        out.close();
+        if(out.fail() || !sync_file(temporary))
+        {
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    if(std::rename(temporary.c_str(), file.c_str()) != 0)
+        return false;
+
+    // The checkpoint only survives a crash once its directory entry is synced too
+    const auto directory = std::filesystem::path{file}.parent_path();
+    return sync_file(directory.empty() ? "."s : directory.string());
+}
+
+std::optional<yar::db::checkpoint> yar::db::checkpoint::load(const std::string& file, yar::db::collection_indexes& indexes)
+{
+    auto in = std::ifstream{file, std::ios::binary};
+    if(!in.is_open())
+        return std::nullopt;
+
+    const auto bytes = std::string{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    auto hash = std::uint64_t{};
+    if(bytes.size() < magic.size() + sizeof hash || !bytes.starts_with(magic))
+        return std::nullopt;
+
+    std::memcpy(&hash, bytes.data() + magic.size(), sizeof hash);
+    const auto payload = std::string_view{bytes}.substr(magic.size() + sizeof hash);
+    if(checksum(payload) != hash)
+        return std::nullopt;
+
+    auto is = std::istringstream{std::string{payload}};
+    auto result = yar::db::checkpoint{};
+    auto offset = std::int64_t{}, last = std::int64_t{}, collections = std::int64_t{};
+    xson::fast::decode(is, offset);
+    xson::fast::decode(is, last);
+    xson::fast::decode(is, result.timestamp);
+    xson::fast::decode(is, collections);
+    result.offset = offset;
+    result.last = last;
+
+    for(auto i = 0ll; i < collections && is; ++i)
+    {
+        auto collection = ""s;
+        xson::fast::decode(is, collection);
+        if(!indexes[collection].load(is))
+            return std::nullopt;
+    }
+
+    if(is.fail())
+        return std::nullopt;
+    return result;
+}
@@ -0,0 +1,184 @@
+module;
+#include <fcntl.h>
+#include <unistd.h>
+module yar;
+import :compaction;
+import :metadata;
+import :storage;
+import std;
+import xson;
+
+namespace {
+
+using namespace std::string_literals;
+
+// What the first pass learns about a record
+struct version
+{
+    yar::db::position_type position = -1;
+    yar::db::position_type previous = -1;
+    yar::db::metadata::action status = yar::db::metadata::created;
+    std::chrono::system_clock::time_point timestamp = {};
+    bool superseded = false;
+    bool keep = false;
+};
+
+auto find_version(std::vector<version>& versions, yar::db::position_type position) -> version*
+{
+    const auto it = std::ranges::lower_bound(versions, position, {}, &version::position);
+    return it != versions.end() && it->position == position ? &*it : nullptr;
+}
+
+bool sync_file(const std::string& file)
+{
+    const auto descriptor = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if(descriptor < 0)
+        return false;
+    const auto synced = ::fsync(descriptor) == 0;
+    ::close(descriptor);
+    return synced;
+}
+
+} // namespace
+
+yar::db::compaction::compaction(std::string file, yar::db::retention policy) :
+    m_file{std::move(file)},
+    m_policy{policy}
+{}
+
+bool yar::db::compaction::copy(const yar::db::storage& log, yar::db::position_type end)
+{
+    m_relocations.clear();
+    m_records = 0;
+    m_before = end;
+
+    // First pass: find the versions of every document and the record carrying the highest _id of every
+    // collection, the records are in log order
+    auto versions = std::vector<version>{};
+    auto highest = std::map<std::string, std::pair<xson::integer_type, yar::db::position_type>>{};
+    log.scan([&versions, &highest, end](const yar::db::metadata& metadata, yar::db::object& document)
+    {
+        if(metadata.position >= end)
+            return;
+        versions.push_back({metadata.position, metadata.previous, metadata.status, metadata.timestamp});
+        if(document.has("_id"s))
+        {
+            const xson::integer_type id = document["_id"s];
+            auto [it, inserted] = highest.try_emplace(metadata.collection, id, metadata.position);
+            if(!inserted && id >= it->second.first)
+                it->second = {id, metadata.position};
+        }
+    });
+    m_records = versions.size();
+
+    // A rebuild without a checkpoint takes the _id sequence from the log, so the record carrying the
+    // highest _id is kept even when deleted, otherwise the _id of a deleted document would be reissued
+    for(const auto& [collection, id] : highest)
+        find_version(versions, id.second)->keep = true;
+
+    for(const auto& v : versions)
+        if(auto* older = v.previous >= 0 ? find_version(versions, v.previous) : nullptr)
+            older->superseded = true;
+
+    // Walk every chain from its newest version, keeping the current one and what the policy retains
+    const auto since = std::chrono::system_clock::now() - m_policy.window;
+    for(auto& head : versions)
+    {
+        if(head.superseded)
+            continue;
+        auto retained = 0uz;
+        for(auto* v = &head; v; v = v->previous >= 0 ? find_version(versions, v->previous) : nullptr)
+        {
+            if(v->status == yar::db::metadata::created)
+                v->keep = true;
+            else if(retained < m_policy.versions || (m_policy.window > std::chrono::seconds::zero() && v->timestamp >= since))
+            {
+                v->keep = true;
+                ++retained;
+            }
+        }
+    }
+
+    // Second pass: copy the kept records, older versions are always copied before the newer ones
+    auto os = std::ofstream{m_file, std::ios::out | std::ios::binary | std::ios::trunc};
+    if(!os.is_open())
+        return false;
+
+    auto success = true;
+    log.scan([&](const yar::db::metadata& metadata, yar::db::object& document)
+    {
+        if(metadata.position >= end || !success)
+            return;
+        if(const auto* v = find_version(versions, metadata.position); v && v->keep)
+            success = write(os, metadata, document);
+    });
+
+    os.flush();
+    m_copied = end;
+    m_after = static_cast<yar::db::position_type>(os.tellp());
+    return success && !os.fail();
+}
+
+bool yar::db::compaction::finish(const yar::db::storage& log)
+{
+    auto os = std::fstream{m_file, std::ios::in | std::ios::out | std::ios::binary};
+    if(!os.is_open())
+        return false;
+
+    // Records updated or deleted while copying had their status byte flipped in the old log
+    for(auto& relocation : m_relocations)
+    {
+        const auto status = log.status(relocation.from);
+        if(!status || *status == relocation.status)
+            continue;
+        const auto marked = yar::db::metadata{*status};
+        os.seekp(relocation.to, os.beg);
+        os << marked;
+        relocation.status = *status;
+    }
+
+    // Everything written after the copy is kept
+    os.seekp(0, os.end);
+    auto success = true;
+    log.scan([&](const yar::db::metadata& metadata, yar::db::object& document)
+    {
+        if(success)
+            success = write(os, metadata, document);
+    }, m_copied);
+
+    os.flush();
+    m_copied = log.committed();
+    m_after = static_cast<yar::db::position_type>(os.tellp());
+    os.close();
+    return success && !os.fail() && sync_file(m_file);
+}
+
+std::optional<yar::db::position_type> yar::db::compaction::remap(yar::db::position_type from) const
+{
+    const auto it = std::ranges::lower_bound(m_relocations, from, {}, &relocation::from);
+    if(it == m_relocations.end() || it->from != from)
+        return std::nullopt;
+    return it->to;
+}
+
+bool yar::db::compaction::write(std::ostream& os, yar::db::metadata metadata, const yar::db::object& document)
+{
+    using xson::fson::operator <<;
+
+    // Timestamps are kept, the history chain skips the versions that were dropped
+    auto relocation = yar::db::compaction::relocation{metadata.position, static_cast<yar::db::position_type>(os.tellp()), metadata.status};
+    metadata.previous = metadata.previous >= 0 ? remap(metadata.previous).value_or(-1) : -1;
+    metadata.position = relocation.to;
+
+    xson::fast::encode(os, metadata.status);
+    xson::fast::encode(os, metadata.collection);
+    xson::fast::encode(os, metadata.timestamp);
+    xson::fast::encode(os, metadata.position);
+    xson::fast::encode(os, metadata.previous);
+    os << document;
+    if(os.fail())
+        return false;
+
+    m_relocations.push_back(relocation);
+    return true;
+}
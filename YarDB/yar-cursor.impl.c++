@@ -0,0 +1,321 @@
+module yar;
+import :cursor;
+import :index;
+import :metadata;
+import :metrics;
+import :planner;
+import :storage;
+import std;
+import xson;
+
+namespace {
+
+using namespace std::string_literals;
+
+constexpr auto hex_digits = std::string_view{"0123456789abcdef"};
+
+auto to_hex(std::string_view bytes)
+{
+    auto hex = std::string{};
+    hex.reserve(bytes.size() * 2);
+    for(const auto c : bytes)
+    {
+        hex.push_back(hex_digits[static_cast<unsigned char>(c) >> 4]);
+        hex.push_back(hex_digits[static_cast<unsigned char>(c) & 0xf]);
+    }
+    return hex;
+}
+
+auto from_hex(std::string_view hex)
+{
+    if(hex.size() % 2 != 0)
+        throw std::invalid_argument{"Invalid continuation token"s};
+
+    auto bytes = std::string{};
+    for(auto i = 0uz; i < hex.size(); i += 2)
+    {
+        const auto high = hex_digits.find(hex[i]), low = hex_digits.find(hex[i + 1]);
+        if(high == hex_digits.npos || low == hex_digits.npos)
+            throw std::invalid_argument{"Invalid continuation token"s};
+        bytes.push_back(static_cast<char>(high << 4 | low));
+    }
+    return bytes;
+}
+
+// Where a previous cursor stopped
+struct continuation
+{
+    std::int64_t consumed = 0;
+    std::string index = ""s;
+    yar::db::secondary_key_type key = {};
+    std::int64_t position = -1;
+};
+
+auto decode_token(std::string_view token)
+{
+    auto is = std::istringstream{from_hex(token)};
+    auto result = continuation{};
+    xson::fast::decode(is, result.consumed);
+    xson::fast::decode(is, result.index);
+    result.key = yar::db::decode_key(is);
+    xson::fast::decode(is, result.position);
+    if(is.fail() || result.consumed < 0)
+        throw std::invalid_argument{"Invalid continuation token"s};
+    return result;
+}
+
+} // namespace
+
+yar::db::cursor::cursor(std::shared_lock<std::shared_mutex> guard, const yar::db::storage& log) :
+    m_guard{std::move(guard)},
+    m_log{&log}
+{
+    if(m_guard.owns_lock())
+        m_guard.unlock();
+}
+
+yar::db::cursor::cursor(std::shared_lock<std::shared_mutex> guard, std::shared_lock<std::shared_mutex> log_guard, const yar::db::storage& log, const yar::db::index& index,
+                        yar::db::query query, std::string_view token, yar::db::collection_metrics* counters) :
+    m_guard{std::move(guard)},
+    m_log_guard{std::move(log_guard)},
+    m_log{&log},
+    m_query{std::move(query)},
+    m_plan{yar::db::make_plan(index, m_query)},
+    m_skip{m_query.skip},
+    m_recorder{counters}
+{
+    if(m_plan.view)
+        m_index = m_plan.indexes.empty() ? "_id"s : m_plan.indexes.front();
+
+    if(!token.empty())
+    {
+        const auto from = decode_token(token);
+        auto resumed = false;
+        if(m_plan.ordering == yar::db::plan::index_order && from.index == m_index && from.position >= 0)
+        {
+            if(!m_plan.view)
+            {
+                // Intersected positions are in index order, the walk continues after the position returned last
+                if(const auto last = std::ranges::find(m_plan.positions, from.position); last != m_plan.positions.end())
+                {
+                    m_next = static_cast<std::size_t>(last - m_plan.positions.begin()) + 1;
+                    resumed = true;
+                }
+            }
+            else if(auto rest = index.resume(m_index, *m_plan.view, from.key, from.position))
+            {
+                m_plan.view.emplace(*rest);
+                resumed = true;
+            }
+        }
+
+        // Sorted results, and walks planned differently since the token was issued, count their way back
+        m_skip = resumed ? 0 : from.consumed;
+        m_consumed = resumed ? from.consumed : 0;
+    }
+
+    // Copy the candidates out of the index, an index order walk keeps the key of each entry for the token
+    // Writers may change the index as soon as the lock is released, the view must not be walked after that
+    if(m_plan.view)
+    {
+        for(auto it = m_plan.view->begin(), end = m_plan.view->end(); it != end; ++it)
+        {
+            if(m_plan.ordering == yar::db::plan::index_order)
+                m_entries.emplace_back(it.key(), *it);
+            else
+                m_plan.positions.push_back(*it);
+        }
+        m_plan.view.reset();
+    }
+    if(m_guard.owns_lock())
+        m_guard.unlock();
+    m_execution.planning = std::chrono::steady_clock::now() - m_start;
+}
+
+yar::db::cursor::~cursor()
+{
+    auto* counters = m_recorder.counters;
+    if(!counters)
+        return;
+
+    const auto execution = statistics();
+    auto& registry = counters->registry;
+    registry.latency(yar::db::operation::read, yar::db::stage::plan).record(execution.planning);
+    registry.latency(yar::db::operation::read, yar::db::stage::decode).record(execution.decoding);
+    registry.latency(yar::db::operation::read, yar::db::stage::match).record(execution.matching);
+    if(m_query.filter)
+        registry.latency(yar::db::operation::read, yar::db::stage::filter).record(execution.filtering);
+    registry.latency(yar::db::operation::read).record(execution.elapsed);
+
+    counters->queries.add();
+    counters->scanned.add(execution.scanned);
+    counters->matched.add(execution.matched);
+    counters->returned.add(execution.returned);
+}
+
+bool yar::db::cursor::next(yar::db::object& document)
+{
+    if(m_execution.returned >= static_cast<std::size_t>(m_query.top))
+        return false;
+
+    if(m_plan.ordering != yar::db::plan::index_order)
+    {
+        if(!m_sorted)
+            sort();
+        if(m_next >= m_sorted->size())
+            return false;
+        document = std::move((*m_sorted)[m_next++]);
+        ++m_execution.returned;
+        ++m_consumed;
+        return true;
+    }
+
+    // Candidates arrive in result order, nothing past the $top-th match is decoded
+    auto position = yar::db::position_type{};
+    while(advance(position))
+    {
+        document = yar::db::object{};
+        if(!decode(position, document))
+            continue;
+        ++m_execution.scanned;
+        if(!matches(document))
+            continue;
+        ++m_execution.matched;
+        ++m_consumed;
+
+        // Skip the first N matching documents
+        if(m_skip > 0)
+        {
+            --m_skip;
+            continue;
+        }
+
+        ++m_execution.returned;
+        m_last_key = m_index.empty() ? yar::db::secondary_key_type{} : m_entries[m_next - 1].first;
+        m_last_position = position;
+        return true;
+    }
+    return false;
+}
+
+bool yar::db::cursor::advance(yar::db::position_type& position)
+{
+    if(!m_index.empty())
+    {
+        if(m_next >= m_entries.size())
+            return false;
+        position = m_entries[m_next++].second;
+        return true;
+    }
+
+    if(m_next >= m_plan.positions.size())
+        return false;
+    position = m_plan.positions[m_next++];
+    return true;
+}
+
+void yar::db::cursor::sort()
+{
+    // Order the matches by the $orderby field, ties keep index order
+    struct entry
+    {
+        yar::db::secondary_key_type key;
+        std::size_t sequence;
+        yar::db::object document;
+    };
+    const auto before = [descending = m_query.descending](const entry& a, const entry& b)
+    {
+        const auto key_less = yar::db::secondary_key_less{};
+        if(key_less(a.key, b.key)) return !descending;
+        if(key_less(b.key, a.key)) return descending;
+        return a.sequence < b.sequence;
+    };
+
+    // top_k keeps only the best $skip + $top matches in a max-heap, sort keeps them all
+    const auto skip = static_cast<std::size_t>(m_skip);
+    const auto limit = m_plan.ordering == yar::db::plan::top_k
+                     ? skip + static_cast<std::size_t>(m_query.top)
+                     : std::numeric_limits<std::size_t>::max();
+    auto entries = std::vector<entry>{};
+    m_plan.for_each([&](yar::db::position_type position)
+    {
+        auto document = yar::db::object{};
+        if(!decode(position, document))
+            return true;
+        ++m_execution.scanned;
+        if(!matches(document))
+            return true;
+
+        auto key = yar::db::sort_key(document, m_query.orderby);
+        entries.emplace_back(std::move(key), m_execution.matched++, std::move(document));
+        if(m_plan.ordering == yar::db::plan::top_k)
+        {
+            std::ranges::push_heap(entries, before);
+            if(entries.size() > limit)
+            {
+                std::ranges::pop_heap(entries, before);
+                entries.pop_back();
+            }
+        }
+        return true;
+    });
+
+    if(m_plan.ordering == yar::db::plan::top_k)
+        std::ranges::sort_heap(entries, before);
+    else
+        std::ranges::sort(entries, before);
+
+    m_sorted.emplace();
+    for(auto& e : entries | std::views::drop(skip))
+        m_sorted->push_back(std::move(e.document));
+    m_consumed += static_cast<yar::db::sequence_type>(std::min(skip, entries.size()));
+    m_skip = 0;
+}
+
+bool yar::db::cursor::decode(yar::db::position_type position, yar::db::object& document)
+{
+    const auto start = std::chrono::steady_clock::now();
+    auto metadata = yar::db::metadata{};
+    // The lock was released after the candidates were copied, a candidate deleted or updated since is not returned
+    const auto decoded = m_log->read(position, metadata, document) && metadata.status == yar::db::metadata::created;
+    m_execution.decoding += std::chrono::steady_clock::now() - start;
+    return decoded;
+}
+
+bool yar::db::cursor::matches(const yar::db::object& document)
+{
+    // Same predicates as query::match, the residual filter (e.g. OData string functions) is timed on its own
+    const auto start = std::chrono::steady_clock::now();
+    const auto selected = document.match(m_query.selector);
+    const auto matched = std::chrono::steady_clock::now();
+    m_execution.matching += matched - start;
+    if(!selected || !m_query.filter)
+        return selected;
+
+    const auto filtered = m_query.filter(document);
+    m_execution.filtering += std::chrono::steady_clock::now() - matched;
+    return filtered;
+}
+
+std::string yar::db::cursor::token() const
+{
+    const auto exhausted = m_plan.ordering != yar::db::plan::index_order
+                         ? !m_sorted || static_cast<std::size_t>(m_consumed) >= m_execution.matched
+                         : m_next >= (m_index.empty() ? m_plan.positions.size() : m_entries.size());
+    if(exhausted)
+        return ""s;
+
+    auto os = std::ostringstream{};
+    xson::fast::encode(os, static_cast<std::int64_t>(m_consumed));
+    xson::fast::encode(os, m_index);
+    yar::db::encode_key(os, m_last_key);
+    xson::fast::encode(os, static_cast<std::int64_t>(m_last_position));
+    return to_hex(os.str());
+}
+
+yar::db::execution yar::db::cursor::statistics() const
+{
+    auto result = m_execution;
+    result.elapsed = std::chrono::steady_clock::now() - m_start;
+    return result;
+}
@@ -1,5 +1,7 @@
 module yar;
 import :metadata;
+import :metrics;
+import :planner;
 import std;
 import net;
 import xson;
@@ -7,6 +9,7 @@ import xson;
 namespace {
 
 using namespace std::string_literals;
+using namespace std::string_view_literals;
 
 auto locks = std::set<std::string>{};
 
@@ -44,17 +47,14 @@ inline void lock(std::string_view db)
 
 // Helper template to extract metadata value from first matching document
 template<typename T, typename Extractor>
-auto metadata_value(std::fstream& storage, const yar::db::index_view& view, const yar::db::object& selector, Extractor extractor) -> std::optional<T>
+auto metadata_value(const yar::db::storage& storage, const yar::db::index_view& view, const yar::db::object& selector, Extractor extractor) -> std::optional<T>
 {
-    using xson::fson::operator >>;
-    
     for(const auto position : view)
     {
         auto metadata = yar::db::metadata{};
         auto document = yar::db::object{};
-        storage.clear();
-        storage.seekg(position, storage.beg);
-        storage >> metadata >> document;
+        if(!storage.read(position, metadata, document))
+            continue;
         if(document.match(selector))
         {
             return extractor(metadata);
@@ -64,54 +64,78 @@ auto metadata_value(std::fstream& storage, const yar::db::index_view& view, cons
     return std::nullopt; // No matching document found
 }
 
+// How often the background checkpointer looks for a grown log
+constexpr auto checkpoint_interval = std::chrono::seconds{60};
+
 } // namespace
 
+
 yar::db::engine::engine(std::string_view db) :
     m_db{db},
     m_collection{"_db"s},
     m_index{},
-    m_storage{}
+    m_storage{},
+    m_mutex{},
+    m_log_mutex{}
 {
     ::lock(m_db);
-    m_storage.open(m_db, std::ios::out | std::ios::in | std::ios::binary);
-    if(!m_storage.is_open())
-        m_storage.open(m_db, std::ios::out | std::ios::in | std::ios::binary | std::ios::trunc);
-    if(!m_storage.is_open())
-        throw std::runtime_error{"Failed to open/create DB "s + m_db};
-    setup_index_structure();
-    populate_indexes();
+    m_storage.open(m_db);
+
+    const auto start = std::chrono::steady_clock::now();
+    m_startup.log_size = m_storage.committed();
+    m_startup.from_checkpoint = load_checkpoint();
+    if(!m_startup.from_checkpoint)
+    {
+        m_index.clear();
+        setup_index_structure();
+        populate_indexes();
+        m_startup.replayed = m_startup.log_size;
+    }
+    m_startup.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+    m_checkpointer = std::jthread{[this](std::stop_token stop){checkpoints(stop);}};
 }
 
+// The checkpointer of the moved-from engine is stopped before anything it uses is taken over,
+// and the moved-from engine neither checkpoints nor unlocks on destruction
 yar::db::engine::engine(yar::db::engine&& e) :
-    m_db{std::move(e.m_db)},
+    m_db{(e.m_checkpointer = std::jthread{}, std::exchange(e.m_db, ""s))},
     m_collection{std::move(e.m_collection)},
     m_index{std::move(e.m_index)},
-    m_storage{std::move(e.m_storage)}
-{}
+    m_storage{std::move(e.m_storage)},
+    m_mutex{},
+    m_log_mutex{},
+    m_covered{e.m_covered},
+    m_checkpointed{e.m_checkpointed},
+    m_startup{e.m_startup},
+    m_metrics{std::move(e.m_metrics)}
+{
+    if(!m_db.empty())
+        m_checkpointer = std::jthread{[this](std::stop_token stop){checkpoints(stop);}};
+}
 
 yar::db::engine::~engine()
 {
+    if(m_db.empty())
+        return;
+
+    m_checkpointer = std::jthread{};
+    write_checkpoint();
     ::unlock(m_db);
 }
 
+yar::db::index& yar::db::engine::collection_index()
+{
+    const auto guard = std::unique_lock{m_mutex};
+    return m_index[m_collection];
+}
+
 // First pass: Set up index structure by discovering secondary keys from _db collection
 // and updating sequence counters for all documents
 void yar::db::engine::setup_index_structure()
 {
-    using xson::fson::operator >>;
-
-    m_storage.clear();
-    m_storage.seekg(0, m_storage.beg);
-
-    while(m_storage)
+    m_storage.scan([this](const yar::db::metadata& metadata, yar::db::object& document)
     {
-        auto metadata = yar::db::metadata{};
-        auto document = yar::db::object{};
-        m_storage >> metadata >> document;
-
-        if(m_storage.fail())
-            break;
-
         auto& index = m_index[metadata.collection];
 
         // Update sequence counter for all documents
@@ -120,7 +144,7 @@ void yar::db::engine::setup_index_structure()
         // Process _db collection documents to set up secondary keys for other collections
         if(metadata.collection == "_db"s)
         {
-            auto collection = document["collection"s];
+            const std::string collection = document["collection"s];
             auto keys = document["keys"s];
             auto temp = std::vector<std::string>{};
             for(const auto& k : keys.get<yar::db::object::array>())
@@ -128,44 +152,199 @@ void yar::db::engine::setup_index_structure()
 
             m_index[collection].add(temp);
         }
-    }
+    });
 }
 
 // Second pass: Populate indexes with document positions
 void yar::db::engine::populate_indexes()
 {
-    using xson::fson::operator >>;
+    for(auto& [collection, index] : m_index)
+        index.clear();
+
+    auto last = yar::db::metadata{};
+    m_storage.scan([this, &last](const yar::db::metadata& metadata, yar::db::object& document)
+    {
+        last = metadata;
+
+        // Skip deleted or updated documents (they're not in the current index)
+        if(metadata.status == metadata::deleted || metadata.status == metadata::updated)
+            return;
+
+        auto& index = m_index[metadata.collection];
+        index.insert(document, metadata.position, std::bind_front(&yar::db::engine::superseded, this));
+    });
 
-    m_storage.clear();
-    m_storage.seekg(0, m_storage.beg);
+    if(last.position >= 0)
+        covered(last);
+}
+
+bool yar::db::engine::load_checkpoint()
+{
+    auto indexes = yar::db::collection_indexes{};
+    const auto checkpoint = yar::db::checkpoint::load(m_db + ".idx"s, indexes);
+    if(!checkpoint || checkpoint->offset > m_storage.committed())
+        return false;
 
-    while(m_storage)
+    // The last covered record must still be where the checkpoint says, ending at the covered offset
+    if(checkpoint->last >= 0)
     {
         auto metadata = yar::db::metadata{};
         auto document = yar::db::object{};
-        m_storage >> metadata >> document;
+        auto next = yar::db::position_type{};
+        if(!m_storage.read(checkpoint->last, metadata, document, next) || metadata.position != checkpoint->last ||
+           metadata.timestamp != checkpoint->timestamp || next != checkpoint->offset)
+            return false;
+    }
+    else if(checkpoint->offset != 0)
+        return false;
 
-        if(m_storage.fail())
-            break;
+    // Versions updated or deleted after the checkpoint was written have had their status byte flipped
+    for(auto& [collection, index] : indexes)
+        index.retain([this](yar::db::position_type position)
+        {
+            return m_storage.status(position) == yar::db::metadata::created;
+        });
 
-        // Skip deleted or updated documents (they're not in the current index)
+    // Replay the log written after the checkpoint
+    auto last = yar::db::metadata{};
+    auto schema_changed = false;
+    m_storage.scan([&](const yar::db::metadata& metadata, yar::db::object& document)
+    {
+        last = metadata;
+
+        // New secondary keys have to be populated from the whole log
+        if(metadata.collection == "_db"s)
+            schema_changed = true;
+        if(schema_changed)
+            return;
+
+        auto& index = indexes[metadata.collection];
+        index.update(document);
         if(metadata.status == metadata::deleted || metadata.status == metadata::updated)
-            continue;
+            return;
+        index.insert(document, metadata.position, std::bind_front(&yar::db::engine::superseded, this));
+    }, checkpoint->offset);
 
-        auto& index = m_index[metadata.collection];
-        index.insert(document, metadata.position);
+    if(schema_changed)
+        return false;
+
+    m_index = std::move(indexes);
+    m_covered = *checkpoint;
+    m_checkpointed = checkpoint->offset;
+    if(last.position >= 0)
+        covered(last);
+    m_startup.replayed = m_storage.committed() - checkpoint->offset;
+    return true;
+}
+
+bool yar::db::engine::superseded(yar::db::position_type position, yar::db::object& document) const
+{
+    auto metadata = yar::db::metadata{};
+    return m_storage.read(position, metadata, document);
+}
+
+void yar::db::engine::covered(const yar::db::metadata& last)
+{
+    m_covered = yar::db::checkpoint{m_storage.appended(), last.position, last.timestamp};
+}
+
+bool yar::db::engine::write_checkpoint()
+{
+    const auto lock = std::lock_guard{m_checkpoint_mutex};
+    auto checkpoint = yar::db::checkpoint{};
+    auto indexes = ""s;
+    {
+        const auto guard = std::shared_lock{m_mutex};
+        if(m_covered.offset == m_checkpointed)
+            return true;
+        checkpoint = m_covered;
+        indexes = yar::db::checkpoint::encode(m_index);
+    }
+
+    // The log must be on disk before a checkpoint claims to cover it
+    if(!m_storage.sync() || !checkpoint.save(m_db + ".idx"s, indexes))
+        return false;
+    m_checkpointed = checkpoint.offset;
+    return true;
+}
+
+void yar::db::engine::checkpoints(std::stop_token stop)
+{
+    while(!stop.stop_requested())
+    {
+        {
+            auto lock = std::unique_lock{m_checkpoint_mutex};
+            m_checkpoint_wakeup.wait_for(lock, stop, checkpoint_interval, []{return false;});
+        }
+        if(!stop.stop_requested())
+            write_checkpoint();
     }
 }
 
+std::optional<yar::db::compaction> yar::db::engine::prepare_compaction(const yar::db::retention& policy)
+{
+    // Only what is committed now is decided on, the rest is copied as is by compact()
+    auto compaction = yar::db::compaction{m_db + ".compact"s, policy};
+    if(!compaction.copy(m_storage, m_storage.committed()))
+    {
+        std::remove(compaction.file().c_str());
+        return std::nullopt;
+    }
+    return compaction;
+}
+
+bool yar::db::engine::compact(yar::db::compaction& compaction)
+{
+    if(!m_storage.commit() || !compaction.finish(m_storage))
+    {
+        std::remove(compaction.file().c_str());
+        return false;
+    }
+
+    {
+        const auto lock = std::lock_guard{m_checkpoint_mutex};
+        const auto log_guard = std::unique_lock{m_log_mutex};
+        const auto guard = std::unique_lock{m_mutex};
+
+        // A checkpoint of the old log must never be validated against the new one
+        std::remove((m_db + ".idx"s).c_str());
+        if(!m_storage.replace(compaction.file()))
+        {
+            std::remove(compaction.file().c_str());
+            m_checkpointed = -1;
+            return false;
+        }
+
+        for(auto& [collection, index] : m_index)
+            index.remap([&compaction](yar::db::position_type position){ return compaction.remap(position); });
+
+        // Every record of the new log is indexed
+        auto last = yar::db::metadata{};
+        auto document = yar::db::object{};
+        if(compaction.last() >= 0 && m_storage.read(compaction.last(), last, document))
+            covered(last);
+        else
+            m_covered = yar::db::checkpoint{};
+        m_checkpointed = -1;
+    }
+
+    write_checkpoint();
+    return true;
+}
+
 void yar::db::engine::reindex()
 {
+    const auto guard = std::unique_lock{m_mutex};
     populate_indexes();
 }
 
 void yar::db::engine::index(std::vector<std::string> keys)
 {
-    auto& index = m_index[m_collection];
-    index.add(keys);
+    auto& index = collection_index();
+    {
+        const auto guard = std::unique_lock{m_mutex};
+        index.add(keys);
+    }
     auto selector = yar::db::object{"collection"s, m_collection};
     auto document = yar::db::object{selector, {"keys"s, index.keys()}};
     auto collection = "_db"s;
@@ -174,70 +353,195 @@ void yar::db::engine::index(std::vector<std::string> keys)
     std::swap(collection, m_collection);
 };
 
-bool yar::db::engine::create(yar::db::object& document)
+bool yar::db::engine::commit(yar::db::durability level)
+{
+    if(level == yar::db::durability::none)
+        return true;
+    if(!m_storage.commit())
+        return false;
+    return level != yar::db::durability::fsync || m_storage.sync();
+}
+
+bool yar::db::engine::sync()
 {
-    using xson::fson::operator <<;
+    return m_storage.sync();
+}
 
-    auto& index = m_index[m_collection];
+bool yar::db::engine::create(yar::db::object& document, yar::db::durability level)
+{
+    auto timer = yar::db::operation_timer{m_metrics.get(), yar::db::operation::create};
+    auto& index = collection_index();
     auto metadata = yar::db::metadata{m_collection};
-    m_storage.clear();
-    m_storage.seekp(0, m_storage.end);
-    index.update(document);
-    m_storage << metadata << document;
-    m_storage.flush();
-    if(m_storage.fail())
+    {
+        const auto guard = std::unique_lock{m_mutex};
+        timer.charge(yar::db::stage::lock);
+        index.update(document);
+    }
+    timer.charge(yar::db::stage::index);
+    if(!m_storage.append(metadata, document))
+        return false;
+    timer.charge(yar::db::stage::write);
+    if(!commit(level))
         return false;
+    timer.charge(yar::db::stage::commit);
     
     // Insert into index using the position that was set by metadata operator<<
     // (which is the start position of the metadata record where data is written)
-    index.insert(document, metadata.position);
+    // With durability::none the record may still be buffered, readers skip it until it is written out
+    const auto guard = std::unique_lock{m_mutex};
+    timer.charge(yar::db::stage::lock);
+    index.insert(document, metadata.position, std::bind_front(&yar::db::engine::superseded, this));
+    covered(metadata);
+    timer.charge(yar::db::stage::index);
     return true;
 }
 
+bool yar::db::engine::create(yar::db::object::array& documents, yar::db::durability level)
+{
+    // The whole batch is checked before anything is appended
+    if(!std::ranges::all_of(documents, [](const yar::db::object& document){ return document.is_object(); }))
+        return false;
+
+    auto timer = yar::db::operation_timer{m_metrics.get(), yar::db::operation::create};
+    auto& index = collection_index();
+    auto positions = std::vector<yar::db::position_type>{};
+    positions.reserve(documents.size());
+
+    // A failed append ends the batch, the records appended before it are still indexed, as a rebuild
+    // from the log would find them
+    auto metadata = yar::db::metadata{m_collection}, last = metadata;
+    auto failed = false;
+    for(auto& document : documents)
+    {
+        metadata = yar::db::metadata{m_collection};
+        {
+            const auto guard = std::unique_lock{m_mutex};
+            timer.charge(yar::db::stage::lock);
+            index.update(document);
+        }
+        timer.charge(yar::db::stage::index);
+        if(!m_storage.append(metadata, document))
+        {
+            failed = true;
+            break;
+        }
+        timer.charge(yar::db::stage::write);
+        positions.push_back(metadata.position);
+        last = metadata;
+    }
+
+    // One write out (and sync) for the whole batch
+    if(!commit(level))
+        return false;
+    timer.charge(yar::db::stage::commit);
+
+    const auto guard = std::unique_lock{m_mutex};
+    timer.charge(yar::db::stage::lock);
+    for(auto i = 0uz; i < positions.size(); ++i)
+        index.insert(documents[i], positions[i], std::bind_front(&yar::db::engine::superseded, this));
+    if(!positions.empty())
+        covered(last);
+    timer.charge(yar::db::stage::index);
+    return !failed;
+}
+
 bool yar::db::engine::read(const yar::db::object& selector, yar::db::object& documents)
 {
-    using xson::fson::operator >>;
+    return std::as_const(*this).read(m_collection, selector, documents);
+}
+
+bool yar::db::engine::read(std::string_view collection, const yar::db::object& selector, yar::db::object& documents) const
+{
+    return read(collection, yar::db::query::from(selector), documents);
+}
 
+bool yar::db::engine::read(std::string_view collection, const yar::db::query& query, yar::db::object& documents) const
+{
     documents = yar::db::object{yar::db::object::array{}};
-    auto top = std::numeric_limits<yar::db::sequence_type>::max();
-    if(selector.has("$top"s))
-        top = selector["$top"s];
+    auto cursor = open(collection, query);
+    auto document = yar::db::object{};
+    while(cursor.next(document))
+        documents += std::move(document);
+    return cursor.statistics().returned > 0;
+}
+
+yar::db::cursor yar::db::engine::open(std::string_view collection, const yar::db::query& query, std::string_view token) const
+{
+    // The rest of the read is recorded by the cursor when it is destroyed
+    const auto start = std::chrono::steady_clock::now();
+    auto log_guard = std::shared_lock{m_log_mutex};
+    auto guard = std::shared_lock{m_mutex};
+    m_metrics->latency(yar::db::operation::read, yar::db::stage::lock).record(std::chrono::steady_clock::now() - start);
+    const auto it = m_index.find(collection);
+    if(it == m_index.end())
+        return yar::db::cursor{std::move(guard), m_storage};
+    return yar::db::cursor{std::move(guard), std::move(log_guard), m_storage, it->second, query, token, &m_metrics->collection(collection)};
+}
 
-    auto skip = sequence_type{0};
-    if(selector.has("$skip"s))
-        skip = selector["$skip"s];
+yar::db::object yar::db::engine::explain(std::string_view collection, const yar::db::query& query) const
+{
+    const auto guard = std::shared_lock{m_mutex};
+    const auto it = m_index.find(collection);
+    if(it == m_index.end())
+        return yar::db::object{"error"s, "Collection not found"s};
+
+    auto cursor = yar::db::cursor{std::shared_lock<std::shared_mutex>{}, std::shared_lock<std::shared_mutex>{}, m_storage, it->second, query};
+    auto document = yar::db::object{};
+    while(cursor.next(document));
+    const auto execution = cursor.statistics();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(execution.elapsed);
+
+    auto result = cursor.plan().describe();
+    result["scanned"s] = static_cast<xson::integer_type>(execution.scanned);
+    result["matched"s] = static_cast<xson::integer_type>(execution.matched);
+    result["returned"s] = static_cast<xson::integer_type>(execution.returned);
+    result["elapsed_us"s] = static_cast<xson::integer_type>(elapsed.count());
+    return result;
+}
 
-    auto success = false;
-    const auto& index = m_index[m_collection];
+void yar::db::engine::expose(yar::db::exposition& out) const
+{
+    m_metrics->expose(out);
 
-    for(const auto position : index.view(selector))
     {
-        auto metadata = yar::db::metadata{};
-        auto document = yar::db::object{};
-        m_storage.clear();
-        m_storage.seekg(position, m_storage.beg);
-        m_storage >> metadata >> document;
-        if(document.match(selector))
+        const auto guard = std::shared_lock{m_mutex};
+        out.family("yardb_index_entries"sv, "gauge"sv, "Entries of the primary (_id) and secondary indexes"sv);
+        for(const auto& [collection, index] : m_index)
         {
-            // Skip the first N matching documents
-            if(skip > 0)
-            {
-                --skip;
-                continue;
-            }
-
-            documents += std::move(document);
-            success = true;
-            if(--top == 0) break;
+            out.sample("yardb_index_entries"sv, {{"collection"sv, collection}, {"index"sv, "_id"sv}}, static_cast<double>(index.size()));
+            for(const auto& name : index.keys())
+                out.sample("yardb_index_entries"sv, {{"collection"sv, collection}, {"index"sv, name}}, static_cast<double>(index.size(name)));
         }
     }
 
-    return success;
+    out.family("yardb_log_bytes"sv, "gauge"sv, "Committed size of the log"sv);
+    out.sample("yardb_log_bytes"sv, {}, static_cast<double>(m_storage.committed()));
+
+    const auto statistics = m_storage.cache().statistics();
+    const auto counters = std::array<std::tuple<std::string_view, std::string_view, std::string_view, std::uint64_t>, 6>{{
+        {"yardb_cache_hits_total"sv, "counter"sv, "Reads served from the document cache"sv, statistics.hits},
+        {"yardb_cache_misses_total"sv, "counter"sv, "Reads that decoded the record"sv, statistics.misses},
+        {"yardb_cache_evictions_total"sv, "counter"sv, "Records evicted from the document cache"sv, statistics.evictions},
+        {"yardb_cache_entries"sv, "gauge"sv, "Records in the document cache"sv, statistics.entries},
+        {"yardb_cache_bytes"sv, "gauge"sv, "Bytes charged for the records in the document cache"sv, statistics.bytes},
+        {"yardb_cache_capacity_bytes"sv, "gauge"sv, "Bytes the document cache may hold"sv, statistics.capacity}
+    }};
+    for(const auto& [name, type, help, value] : counters)
+    {
+        out.family(name, type, help);
+        out.sample(name, {}, static_cast<double>(value));
+    }
 }
 
 std::optional<std::chrono::system_clock::time_point> yar::db::engine::metadata_timestamp(const yar::db::object& selector) const
 {
-    const auto it = m_index.find(m_collection);
+    return metadata_timestamp(m_collection, selector);
+}
+
+std::optional<std::chrono::system_clock::time_point> yar::db::engine::metadata_timestamp(std::string_view collection, const yar::db::object& selector) const
+{
+    const auto guard = std::shared_lock{m_mutex};
+    const auto it = m_index.find(collection);
     if(it == m_index.end())
         return std::nullopt;
     const auto& index = it->second;
@@ -247,7 +551,13 @@ std::optional<std::chrono::system_clock::time_point> yar::db::engine::metadata_t
 
 std::optional<std::int64_t> yar::db::engine::metadata_position(const yar::db::object& selector) const
 {
-    const auto it = m_index.find(m_collection);
+    return metadata_position(m_collection, selector);
+}
+
+std::optional<std::int64_t> yar::db::engine::metadata_position(std::string_view collection, const yar::db::object& selector) const
+{
+    const auto guard = std::shared_lock{m_mutex};
+    const auto it = m_index.find(collection);
     if(it == m_index.end())
         return std::nullopt;
     const auto& index = it->second;
@@ -255,106 +565,163 @@ std::optional<std::int64_t> yar::db::engine::metadata_position(const yar::db::ob
         m_storage, index.view(selector), selector, [](const yar::db::metadata& m) { return m.position; });
 }
 
-bool yar::db::engine::update(const yar::db::object& selector, const yar::db::object& updates, yar::db::object& documents)
+bool yar::db::engine::update(const yar::db::object& selector, const yar::db::object& updates, yar::db::object& documents, yar::db::durability level)
 {
-    using xson::fson::operator >>;
-    using xson::fson::operator <<;
-
     documents = yar::db::object{yar::db::object::array{}};
-    auto success = false;
-    auto& index = m_index[m_collection];
+    auto success = false, failed = false;
+    auto timer = yar::db::operation_timer{m_metrics.get(), yar::db::operation::update};
+    auto& index = collection_index();
+    timer.charge(yar::db::stage::lock);
 
-    for(const auto position : index.view(selector))
-    {
-        using namespace xson::fson;
+    // Records still in the append buffer must be readable to be updated
+    if(m_storage.pending() > 0 && !m_storage.commit())
+        return false;
+    timer.charge(yar::db::stage::commit);
 
+    // Writers are serialized by the caller, so the index can be walked without the shared lock
+    // New versions are indexed only after they have been committed and are visible to readers
+    auto positions = std::vector<yar::db::position_type>{};
+    auto old_documents = std::vector<yar::db::object>{};
+    auto last = yar::db::metadata{};
+    const auto view = index.view(selector);
+    timer.charge(yar::db::stage::plan);
+
+    for(const auto position : view)
+    {
         auto metadata = yar::db::metadata{};
         auto old_document = yar::db::object{};
-        m_storage.clear();
-        m_storage.seekg(position, m_storage.beg);
-        m_storage >> metadata >> old_document;
-        if(old_document.match(selector))
+        const auto decoded = m_storage.read(position, metadata, old_document);
+        timer.charge(yar::db::stage::decode);
+        if(!decoded)
+            continue;
+        const auto matched = old_document.match(selector);
+        timer.charge(yar::db::stage::match);
+        if(matched)
         {
-            m_storage.clear();
-            m_storage.seekp(position, m_storage.beg);
-            m_storage << yar::db::updated;
-
-            auto new_document = std::move(old_document);
+            auto new_document = old_document;
             new_document += updates;
+            {
+                const auto guard = std::unique_lock{m_mutex};
+                timer.charge(yar::db::stage::lock);
+                index.update(new_document);
+            }
+            timer.charge(yar::db::stage::index);
 
-            m_storage.clear();
-            m_storage.seekp(0, m_storage.end);
-            index.update(new_document);
-            index.insert(new_document, m_storage.tellp());
-            m_storage << metadata << new_document;
+            // The new version goes first, a failed append leaves the old one current
+            // A failed mark leaves both current, the later one wins when the log is replayed
+            if(!m_storage.append(metadata, new_document))
+            {
+                failed = true;
+                break;
+            }
+            failed = !m_storage.mark(position, yar::db::updated) || failed;
+            positions.push_back(metadata.position);
+            old_documents.push_back(std::move(old_document));
+            last = metadata;
 
             documents += std::move(new_document);
             success = true;
+            timer.charge(yar::db::stage::write);
         }
     }
 
-    if(success)
-        m_storage.flush();
+    if(!success)
+        return false;
 
-    return success;
+    // The old versions leave the index, so the new ones are written out for every level to stay
+    // readable, durability::none only leaves the sync to the committer
+    if(!commit(level == yar::db::durability::none ? yar::db::durability::flush : level))
+        return false;
+    timer.charge(yar::db::stage::commit);
+
+    const auto guard = std::unique_lock{m_mutex};
+    timer.charge(yar::db::stage::lock);
+    auto& versions = documents.get<yar::db::object::array>();
+    for(auto i = 0u; i < positions.size(); ++i)
+    {
+        // Drop the secondary entries of the old version, its keys may have changed
+        index.erase(old_documents[i]);
+        index.insert(versions[i], positions[i], std::bind_front(&yar::db::engine::superseded, this));
+    }
+    covered(last);
+    timer.charge(yar::db::stage::index);
+    return !failed;
 }
 
-bool yar::db::engine::destroy(const yar::db::object& selector, yar::db::object& documents)
+bool yar::db::engine::destroy(const yar::db::object& selector, yar::db::object& documents, yar::db::durability level)
 {
-    using xson::fson::operator >>;
-
     documents = yar::db::object{yar::db::object::array{}};
     auto top = std::numeric_limits<yar::db::sequence_type>::max();
     if(selector.has("$top"s))
         top = selector["$top"s];
 
     auto success = false;
-    auto& index = m_index[m_collection];
+    auto timer = yar::db::operation_timer{m_metrics.get(), yar::db::operation::destroy};
+    auto& index = collection_index();
+    timer.charge(yar::db::stage::lock);
 
-    for(const auto position : index.view(selector))
+    // Records still in the append buffer must be readable to be deleted
+    if(m_storage.pending() > 0 && !m_storage.commit())
+        return false;
+    timer.charge(yar::db::stage::commit);
+
+    const auto view = index.view(selector);
+    timer.charge(yar::db::stage::plan);
+    for(const auto position : view)
     {
         auto metadata = yar::db::metadata{};
         auto document = yar::db::object{};
-        m_storage.clear();
-        m_storage.seekg(position, m_storage.beg);
-        m_storage >> metadata >> document;
-        if(document.match(selector))
+        const auto decoded = m_storage.read(position, metadata, document);
+        timer.charge(yar::db::stage::decode);
+        if(!decoded)
+            continue;
+        const auto matched = document.match(selector);
+        timer.charge(yar::db::stage::match);
+        if(matched)
         {
-            m_storage.clear();
-            m_storage.seekp(position, m_storage.beg);
-            m_storage << yar::db::deleted;
+            m_storage.mark(position, yar::db::deleted);
             documents += std::move(document);
             success = true;
+            timer.charge(yar::db::stage::write);
 
             if(--top == 0) break;
         }
     }
 
+    // The marks are made, so the documents leave the index even if making them durable fails
+    auto committed = true;
     if(success)
-        m_storage.flush();
+    {
+        committed = commit(level);
+        timer.charge(yar::db::stage::commit);
+    }
 
+    const auto guard = std::unique_lock{m_mutex};
+    timer.charge(yar::db::stage::lock);
     for(const auto& document : documents.get<yar::db::object::array>())
         index.erase(document);
+    timer.charge(yar::db::stage::index);
 
-    return success;
+    return success && committed;
 }
 
 bool yar::db::engine::history(const yar::db::object& selector, yar::db::object& documents)
 {
-    using xson::fson::operator >>;
-
     documents = yar::db::object{yar::db::object::array{}};
     auto success = false;
-    const auto& index = m_index[m_collection];
+    const auto guard = std::shared_lock{m_mutex};
+    const auto it = m_index.find(m_collection);
+    if(it == m_index.end())
+        return success;
+    const auto& index = it->second;
 
     for(auto position : index.view(selector))
         while(position >= 0)
         {
             auto metadata = yar::db::metadata{};
             auto document = yar::db::object{};
-            m_storage.clear();
-            m_storage.seekg(position, m_storage.beg);
-            m_storage >> metadata >> document;
+            if(!m_storage.read(position, metadata, document))
+                break;
             position = metadata.previous;
             documents += std::move(document);
             success = true;
@@ -1,5 +1,9 @@
 module yar;
 import :engine;
+import :index;
+import :metrics;
+import :planner;
+import :storage;
 import tester;
 import std;
 import xson;
@@ -17,6 +21,8 @@ public:
         // Remove any existing PID file
         string pid_file = string{file} + ".pid";
         remove(pid_file.c_str());
+        string idx_file = string{file} + ".idx";
+        remove(idx_file.c_str());
 
         auto fs = fstream{};
         fs.open(file,ios::out);
@@ -29,6 +35,9 @@ public:
         // Also remove the PID lock file
         string pid_file = string{file} + ".pid";
         remove(pid_file.c_str());
+        // And the index checkpoint
+        string idx_file = string{file} + ".idx";
+        remove(idx_file.c_str());
     }
 private:
     std::string file;
@@ -329,7 +338,690 @@ auto test_set()
             engine.index({"D", "1", "2"});
             engine.reindex();
         };
+
+        section("DuplicateSecondaryKeys") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            auto document1 = object{{"status"s, "open"s}, {"N"s, 1}},
+                document2 = object{{"status"s, "open"s}, {"N"s, 2}},
+                document3 = object{{"status"s, "closed"s}, {"N"s, 3}},
+                selector = object{"status"s, "open"s},
+                documents = object{};
+            engine.collection("DuplicateSecondaryKeys");
+            engine.index({"status"});
+            require_true(engine.create(document1));
+            require_true(engine.create(document2));
+            require_true(engine.create(document3));
+            require_true(engine.read(selector, documents));
+            require_true(2u == documents.size());
+
+            // Moving a document to another key drops its old entry
+            require_true(engine.update(object{"N"s, 1}, object{"status"s, "closed"s}));
+            documents = object{};
+            require_true(engine.read(selector, documents));
+            require_true(1u == documents.size());
+            require_true(documents[0].match(document2));
+
+            // Reindexing does not duplicate entries
+            engine.reindex();
+            documents = object{};
+            require_true(engine.read(object{"status"s, "closed"s}, documents));
+            require_true(2u == documents.size());
+
+            // Creating a document under an existing _id drops the entries of the version it supersedes
+            auto replacement = object{{"_id"s, document3["_id"s]}, {"status"s, "open"s}, {"N"s, 4}};
+            require_true(engine.create(replacement));
+            documents = object{};
+            require_true(engine.read(object{"status"s, "closed"s}, documents));
+            require_true(1u == documents.size());
+            require_true(documents[0].match(object{"N"s, 1}));
+            documents = object{};
+            require_true(engine.read(selector, documents));
+            require_true(2u == documents.size());
+
+            // Replaying the log indexes the latest version only
+            engine.reindex();
+            documents = object{};
+            require_true(engine.read(object{"status"s, "closed"s}, documents));
+            require_true(1u == documents.size());
+        };
+
+        section("TypedSecondaryKeys") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            auto selector = object{"N"s, object{{"$gt"s, 9}, {"$lt"s, 100}}},
+                documents = object{};
+            engine.collection("TypedSecondaryKeys");
+            engine.index({"N"});
+            for(auto n : {1, 9, 10, 20, 100})
+            {
+                auto document = object{"N"s, n};
+                require_true(engine.create(document));
+            }
+
+            // Numeric order, not lexicographic ("10" < "9")
+            require_true(engine.read(selector, documents));
+            require_true(2u == documents.size());
+            require_true(10 == static_cast<xson::integer_type>(documents[0]["N"s]));
+            require_true(20 == static_cast<xson::integer_type>(documents[1]["N"s]));
+        };
+
+        section("CompoundSecondaryKeys") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            auto documents = object{};
+            engine.collection("CompoundSecondaryKeys");
+            engine.index({"customer_id,total"});
+            for(auto [customer, total] : {pair{1, 10}, pair{1, 50}, pair{2, 30}, pair{1, 70}})
+            {
+                auto document = object{{"customer_id"s, customer}, {"total"s, total}};
+                require_true(engine.create(document));
+            }
+
+            // Equality on the leading field selects the prefix range
+            require_true(engine.read(object{"customer_id"s, 1}, documents));
+            require_true(3u == documents.size());
+
+            // Equality on the leading field and a range on the next one
+            documents = object{};
+            require_true(engine.read(object{{"customer_id"s, 1}, {"total"s, object{"$gte"s, 50}}}, documents));
+            require_true(2u == documents.size());
+            require_true(50 == static_cast<xson::integer_type>(documents[0]["total"s]));
+            require_true(70 == static_cast<xson::integer_type>(documents[1]["total"s]));
+
+            // A document lacking the trailing field is still found by its leading field
+            auto partial = object{"customer_id"s, 1};
+            require_true(engine.create(partial));
+            documents = object{};
+            require_true(engine.read(object{"customer_id"s, 1}, documents));
+            require_true(4u == documents.size());
+            documents = object{};
+            require_true(engine.read(object{{"customer_id"s, 1}, {"total"s, object{"$lte"s, 50}}}, documents));
+            require_true(2u == documents.size());
+        };
+
+        section("PlannedOrderBy") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            engine.collection("PlannedOrderBy");
+            for(auto i = 0; i < 20; ++i)
+            {
+                auto document = object{"score"s, (i * 7) % 20};
+                require_true(engine.create(document));
+            }
+
+            auto query = yar::db::query{};
+            query.orderby = "score"s;
+            query.descending = true;
+            query.top = 3;
+
+            // Without an index on score the best three matches are kept in a heap
+            auto documents = object{};
+            require_true(engine.read("PlannedOrderBy"sv, query, documents));
+            require_true(3u == documents.size());
+            require_true(19 == static_cast<xson::integer_type>(documents[0]["score"s]));
+            require_true(17 == static_cast<xson::integer_type>(documents[2]["score"s]));
+            require_true("top_k"s == static_cast<string>(engine.explain("PlannedOrderBy"sv, query)["ordering"s]));
+
+            // The residual filter is applied before $top
+            query.filter = [](const object& document){return static_cast<xson::integer_type>(document["score"s]) % 2 == 1;};
+            documents = object{};
+            require_true(engine.read("PlannedOrderBy"sv, query, documents));
+            require_true(3u == documents.size());
+            require_true(15 == static_cast<xson::integer_type>(documents[2]["score"s]));
+
+            // With an index on score the index is walked in order and the walk stops after $top matches
+            query.filter = {};
+            engine.index({"score"});
+            engine.reindex();
+            documents = object{};
+            require_true(engine.read("PlannedOrderBy"sv, query, documents));
+            require_true(3u == documents.size());
+            require_true(19 == static_cast<xson::integer_type>(documents[0]["score"s]));
+            require_true(17 == static_cast<xson::integer_type>(documents[2]["score"s]));
+            const auto plan = engine.explain("PlannedOrderBy"sv, query);
+            require_true("index_order"s == static_cast<string>(plan["ordering"s]));
+            require_true(3 == static_cast<xson::integer_type>(plan["scanned"s]));
+        };
+
+        section("PlannedIntersection") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            engine.collection("PlannedIntersection");
+            engine.index({"x", "y"});
+            for(auto i = 0; i < 100; ++i)
+            {
+                auto document = object{{"x"s, i % 10}, {"y"s, i % 4}};
+                require_true(engine.create(document));
+            }
+
+            // Both predicates are selective enough to intersect their position lists before decoding
+            const auto query = yar::db::query::from(object{{"x"s, 3}, {"y"s, 1}});
+            auto documents = object{};
+            require_true(engine.read("PlannedIntersection"sv, query, documents));
+            require_true(5u == documents.size());
+
+            const auto plan = engine.explain("PlannedIntersection"sv, query);
+            require_true("intersection"s == static_cast<string>(plan["access"s]));
+            require_true(5 == static_cast<xson::integer_type>(plan["scanned"s]));
+            require_true(5 == static_cast<xson::integer_type>(plan["returned"s]));
+        };
+
+        section("IntersectionOrder") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            engine.collection("IntersectionOrder");
+            engine.index({"x", "y"});
+            for(auto i = 0; i < 100; ++i)
+            {
+                auto document = object{{"x"s, 9 - i % 10}, {"y"s, i % 3}};
+                require_true(engine.create(document));
+            }
+            const auto ids = [&engine](const yar::db::query& query)
+            {
+                auto documents = object{};
+                engine.read("IntersectionOrder"sv, query, documents);
+                auto result = std::vector<xson::integer_type>{};
+                for(const auto& document : documents.get<object::array>())
+                    result.push_back(static_cast<xson::integer_type>(document["_id"s]));
+                return result;
+            };
+
+            // The range on x drives the intersection, its key order is not the log order
+            const auto range = object{"x"s, object{{"$gte"s, 2}, {"$lte"s, 3}}};
+            const auto intersected = yar::db::query::from(object{{"x"s, object{{"$gte"s, 2}, {"$lte"s, 3}}}, {"y"s, 1}});
+            require_true("intersection"s == static_cast<string>(engine.explain("IntersectionOrder"sv, intersected)["access"s]));
+
+            // Walking the x index alone and filtering on y returns the same documents in the same order
+            auto single = yar::db::query::from(range);
+            single.filter = [](const object& document){ return 1 == static_cast<xson::integer_type>(document["y"s]); };
+            require_true("secondary_index"s == static_cast<string>(engine.explain("IntersectionOrder"sv, single)["access"s]));
+            const auto expected = ids(single);
+            require_true(7u == expected.size());
+            require_true(expected == ids(intersected));
+        };
+
+        section("CursorPaging") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            engine.collection("CursorPaging");
+            engine.index({"score"});
+            for(auto i = 0; i < 50; ++i)
+            {
+                auto document = object{{"score"s, i % 10}, {"rank"s, (i * 7) % 50}};
+                require_true(engine.create(document));
+            }
+
+            const auto pages = [&engine](yar::db::query query, std::size_t& scanned)
+            {
+                auto ids = std::vector<xson::integer_type>{};
+                auto token = ""s;
+                scanned = 0;
+                do
+                {
+                    auto cursor = engine.open("CursorPaging"sv, query, token);
+                    auto page = 0u;
+                    for(auto document = object{}; cursor.next(document); ++page)
+                        ids.push_back(static_cast<xson::integer_type>(document["_id"s]));
+                    require_true(page <= 7u);
+                    scanned = std::max(scanned, cursor.statistics().scanned);
+                    token = cursor.token();
+                }
+                while(!token.empty());
+                return ids;
+            };
+            const auto all = [&engine](const yar::db::query& query)
+            {
+                auto documents = object{};
+                engine.read("CursorPaging"sv, query, documents);
+                auto ids = std::vector<xson::integer_type>{};
+                for(const auto& document : documents.get<object::array>())
+                    ids.push_back(static_cast<xson::integer_type>(document["_id"s]));
+                return ids;
+            };
+
+            // Walking the primary index, every page decodes only its own documents
+            auto query = yar::db::query{};
+            query.top = 7;
+            auto scanned = 0uz;
+            auto unpaged = query;
+            unpaged.top = std::numeric_limits<yar::db::sequence_type>::max();
+            require_true(all(unpaged) == pages(query, scanned));
+            require_true(7u == scanned);
+
+            // Walking the secondary index through duplicate keys, descending
+            query.orderby = "score"s;
+            query.descending = true;
+            unpaged.orderby = "score"s;
+            unpaged.descending = true;
+            require_true(50u == pages(query, scanned).size());
+            require_true(all(unpaged) == pages(query, scanned));
+            require_true(7u == scanned);
+
+            // Sorting without an index falls back to counting the documents already returned
+            query = yar::db::query{};
+            query.orderby = "rank"s;
+            query.top = 7;
+            unpaged = query;
+            unpaged.top = std::numeric_limits<yar::db::sequence_type>::max();
+            require_true(all(unpaged) == pages(query, scanned));
+
+            // Documents created between pages show up on the later pages of an index walk
+            query = yar::db::query{};
+            query.top = 30;
+            auto token = ""s;
+            {
+                auto cursor = engine.open("CursorPaging"sv, query);
+                for(auto document = object{}; cursor.next(document);)
+                    ;
+                token = cursor.token();
+            }
+            require_false(token.empty());
+            auto document = object{{"score"s, 9}, {"rank"s, 50}};
+            require_true(engine.create(document));
+            auto count = 0;
+            {
+                auto cursor = engine.open("CursorPaging"sv, query, token);
+                for(auto next = object{}; cursor.next(next); ++count)
+                    ;
+            }
+            require_true(21 == count);
+
+            // An open cursor does not hold writers back, a document deleted meanwhile is not returned
+            // and one created meanwhile is not among the copied candidates
+            count = 0;
+            {
+                auto cursor = engine.open("CursorPaging"sv, yar::db::query{});
+                auto created = object{{"score"s, 9}, {"rank"s, 51}};
+                require_true(engine.create(created));
+                require_true(engine.destroy(object{"rank"s, 50}));
+                for(auto next = object{}; cursor.next(next); ++count)
+                    require_true(50 != static_cast<xson::integer_type>(next["rank"s]));
+            }
+            require_true(50 == count);
+
+            // Malformed tokens are rejected
+            auto rejected = false;
+            try
+            {
+                engine.open("CursorPaging"sv, query, "zz"sv);
+            }
+            catch(const std::invalid_argument&)
+            {
+                rejected = true;
+            }
+            require_true(rejected);
+        };
+
+        section("DurabilityLevels") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            auto documents = object{};
+            engine.collection("DurabilityLevels");
+
+            // Buffered records become readable once written out
+            auto buffered = object{"level"s, "none"s};
+            require_true(engine.create(buffered, yar::db::durability::none));
+            require_true(engine.sync());
+            require_true(engine.read(object{"level"s, "none"s}, documents));
+            require_true(1u == documents.size());
+
+            // A record still in the append buffer can be updated right away
+            auto pending = object{"level"s, "pending"s};
+            require_true(engine.create(pending, yar::db::durability::none));
+            require_true(engine.update(object{"_id"s, pending["_id"s]}, object{"level"s, "updated"s}));
+            documents = object{};
+            require_true(engine.read(object{"level"s, "updated"s}, documents));
+            require_true(1u == documents.size());
+
+            // An update without durability stays readable, it only skips the sync
+            require_true(engine.update(object{"_id"s, pending["_id"s]}, object{"level"s, "unsynced"s}, yar::db::durability::none));
+            documents = object{};
+            require_true(engine.read(object{"_id"s, pending["_id"s]}, documents));
+            require_true(1u == documents.size());
+            require_true(documents[0].match(object{"level"s, "unsynced"s}));
+
+            auto durable = object{"level"s, "fsync"s};
+            require_true(engine.create(durable, yar::db::durability::fsync));
+            documents = object{};
+            require_true(engine.read(object{"level"s, "fsync"s}, documents));
+            require_true(1u == documents.size());
+        };
+
+        section("BatchCreate") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            auto documents = object{};
+            engine.collection("BatchCreate");
+            auto batch = object::array{object{"N"s, 1}, object{"N"s, 2}, object{"N"s, 3}};
+            require_true(engine.create(batch, yar::db::durability::fsync));
+            require_true(batch[2].has("_id"s));
+            require_true(engine.read(object{}, documents));
+            require_true(3u == documents.size());
+            require_true(3 == static_cast<xson::integer_type>(documents[2]["N"s]));
+
+            // An element that is not an object fails the batch before anything is appended
+            auto invalid = json::parse(R"([{"N":4},5])");
+            require_false(engine.create(invalid.get<object::array>()));
+            documents = object{};
+            require_true(engine.read(object{}, documents));
+            require_true(3u == documents.size());
+        };
+
+        section("CheckpointRestart") = [test_file]
+        {
+            {
+                auto engine = yar::db::engine{test_file};
+                engine.collection("CheckpointRestart");
+                engine.index({"k"});
+                for(auto i = 0; i < 10; ++i)
+                {
+                    auto document = object{{"k"s, i % 2}, {"N"s, i}};
+                    require_true(engine.create(document));
+                }
+                require_true(engine.write_checkpoint());
+
+                // A delete only flips the status byte of a covered record, so no new checkpoint is
+                // written on shutdown and the restart has to notice it in the log
+                require_true(engine.destroy(object{"N"s, 1}));
+            }
+
+            {
+                auto engine = yar::db::engine{test_file};
+                require_true(engine.startup().from_checkpoint);
+                auto documents = object{};
+                require_true(engine.read("CheckpointRestart"sv, object{}, documents));
+                require_true(9u == documents.size());
+                documents = object{};
+                require_true(engine.read("CheckpointRestart"sv, object{"k"s, 1}, documents));
+                require_true(4u == documents.size());
+
+                // Sequence counters were restored, new documents get fresh ids
+                engine.collection("CheckpointRestart");
+                auto document = object{{"k"s, 1}, {"N"s, 10}};
+                require_true(engine.create(document));
+                require_true(engine.update(object{"N"s, 3}, object{"k"s, 2}));
+            }
+
+            auto engine = yar::db::engine{test_file};
+            require_true(engine.startup().from_checkpoint);
+            auto documents = object{};
+            require_true(engine.read("CheckpointRestart"sv, object{}, documents));
+            require_true(10u == documents.size());
+            documents = object{};
+            require_true(engine.read("CheckpointRestart"sv, object{"k"s, 1}, documents));
+            require_true(4u == documents.size());
+            documents = object{};
+            require_true(engine.read("CheckpointRestart"sv, object{"k"s, 2}, documents));
+            require_true(1u == documents.size());
+            require_true(3 == static_cast<xson::integer_type>(documents[0]["N"s]));
+        };
+
+        section("Compaction") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            engine.collection("Compaction");
+            engine.index({"k"});
+            auto document = object{{"k"s, 1}, {"V"s, 1}};
+            require_true(engine.create(document));
+            const auto id = document["_id"s];
+            for(auto v = 2; v <= 4; ++v)
+                require_true(engine.update(object{"_id"s, id}, object{"V"s, v}));
+            auto deleted = object{{"k"s, 2}, {"V"s, 1}};
+            require_true(engine.create(deleted));
+            require_true(engine.destroy(object{"_id"s, deleted["_id"s]}));
+
+            // The current version and one previous version of each document survive
+            auto compaction = engine.prepare_compaction(yar::db::retention{.versions = 1});
+            require_true(compaction.has_value());
+            require_true(engine.compact(*compaction));
+            require_true(compaction->after() < compaction->before());
+
+            auto documents = object{};
+            engine.collection("Compaction");
+            require_true(engine.history(object{"_id"s, id}, documents));
+            require_true(2u == documents.size());
+            require_true(4 == static_cast<xson::integer_type>(documents[0]["V"s]));
+            require_true(3 == static_cast<xson::integer_type>(documents[1]["V"s]));
+
+            // Indexes point into the new log
+            documents = object{};
+            require_true(engine.read("Compaction"sv, object{"k"s, 1}, documents));
+            require_true(1u == documents.size());
+            documents = object{};
+            require_false(engine.read("Compaction"sv, object{"k"s, 2}, documents));
+        };
+
+        section("CompactionKeepsSequence") = []
+        {
+            const auto test_file = "./engine_sequence_test.db";
+            const auto setup = fixture{test_file};
+            auto deleted_id = xson::integer_type{};
+            {
+                auto engine = yar::db::engine{test_file};
+                engine.collection("CompactionKeepsSequence");
+                auto kept = object{"N"s, 1}, deleted = object{"N"s, 2};
+                require_true(engine.create(kept));
+                require_true(engine.create(deleted));
+                deleted_id = deleted["_id"s];
+                require_true(engine.destroy(object{"_id"s, deleted_id}));
+                auto compaction = engine.prepare_compaction({});
+                require_true(compaction.has_value());
+                require_true(engine.compact(*compaction));
+            }
+
+            // Rebuilt from the log alone, the _id of the deleted document is not reissued
+            remove((string{test_file} + ".idx").c_str());
+            auto engine = yar::db::engine{test_file};
+            require_false(engine.startup().from_checkpoint);
+            engine.collection("CompactionKeepsSequence");
+            auto document = object{"N"s, 3};
+            require_true(engine.create(document));
+            require_true(static_cast<xson::integer_type>(document["_id"s]) > deleted_id);
+            auto documents = object{};
+            require_true(engine.read(object{}, documents));
+            require_true(2u == documents.size());
+        };
+
+        section("CompactionStaleSecondaryEntry") = []
+        {
+            auto index = yar::db::index{};
+            index.add("k"s);
+            auto document = object{{"_id"s, 1}, {"k"s, 1}};
+            index.insert(document, 10, {});
+
+            // A superseded version decoded with other keys than it was indexed under leaves its entry behind
+            auto version = object{{"_id"s, 1}, {"k"s, 2}};
+            index.insert(version, 20, [](yar::db::position_type, object& previous)
+            {
+                previous = object{{"_id"s, 1}, {"k"s, 3}};
+                return true;
+            });
+            require_eq(index.size("k"s), 2uz);
+
+            // The stale entry is dropped even when its record survives the compaction
+            index.remap([](yar::db::position_type position){ return std::optional{position / 10}; });
+            require_eq(index.size(), 1uz);
+            require_eq(index.size("k"s), 1uz);
+            auto positions = vector<yar::db::position_type>{};
+            for(const auto position : index.view(object{"k"s, 2}))
+                positions.push_back(position);
+            require_true(positions == vector<yar::db::position_type>{2});
+        };
+
+        section("CompactionWhileWriting") = [test_file]
+        {
+            {
+                auto engine = yar::db::engine{test_file};
+                engine.collection("CompactionWhileWriting");
+                for(auto i = 0; i < 10; ++i)
+                {
+                    auto document = object{"N"s, i};
+                    require_true(engine.create(document));
+                }
+
+                // Writes between the copy and the swap are carried over, including marks on copied records
+                auto compaction = engine.prepare_compaction({});
+                require_true(compaction.has_value());
+                require_true(engine.update(object{"N"s, 0}, object{"N"s, 10}));
+                require_true(engine.destroy(object{"N"s, 1}));
+                auto document = object{"N"s, 11};
+                require_true(engine.create(document, yar::db::durability::none));
+                require_true(engine.compact(*compaction));
+
+                auto documents = object{};
+                require_true(engine.read("CompactionWhileWriting"sv, object{}, documents));
+                require_true(10u == documents.size());
+                documents = object{};
+                require_false(engine.read("CompactionWhileWriting"sv, object{"N"s, 1}, documents));
+            }
+
+            // The new log and its checkpoint are consistent after a restart
+            auto engine = yar::db::engine{test_file};
+            require_true(engine.startup().from_checkpoint);
+            auto documents = object{};
+            require_true(engine.read("CompactionWhileWriting"sv, object{}, documents));
+            require_true(10u == documents.size());
+        };
+
+        section("CorruptCheckpoint") = [test_file]
+        {
+            {
+                auto engine = yar::db::engine{test_file};
+                engine.collection("CorruptCheckpoint");
+                auto document = object{"N"s, 1};
+                require_true(engine.create(document));
+            }
+
+            // Flip a byte in the middle of the checkpoint, the checksum no longer matches
+            const auto idx_file = string{test_file} + ".idx";
+            {
+                auto fs = fstream{idx_file, ios::in | ios::out | ios::binary};
+                require_true(fs.is_open());
+                fs.seekg(0, ios::end);
+                const auto size = static_cast<streamoff>(fs.tellg());
+                fs.seekp(size / 2);
+                fs.put('\xff');
+            }
+
+            auto engine = yar::db::engine{test_file};
+            require_false(engine.startup().from_checkpoint);
+            auto documents = object{};
+            require_true(engine.read("CorruptCheckpoint"sv, object{}, documents));
+            require_true(1u == documents.size());
+        };
+
+        section("Metrics") = [test_file]
+        {
+            auto engine = yar::db::engine{test_file};
+            engine.collection("Metrics");
+            engine.index({"N"s});
+            for(auto n : {1, 2, 3, 4})
+            {
+                auto document = object{"N"s, n};
+                require_true(engine.create(document));
+            }
+            auto documents = object{};
+            require_true(engine.read(object{"N"s, 2}, documents));
+            require_true(engine.update(object{"N"s, 3}, object{"M"s, 1}));
+            require_true(engine.destroy(object{"N"s, 4}));
+
+            const auto& metrics = engine.metrics();
+            require_true(metrics.latency(yar::db::operation::create).collect().count >= 4u);
+            require_true(metrics.latency(yar::db::operation::create, yar::db::stage::write).collect().count >= 4u);
+            require_true(metrics.latency(yar::db::operation::read).collect().count >= 1u);
+            require_true(metrics.latency(yar::db::operation::read, yar::db::stage::decode).collect().count >= 1u);
+            require_true(metrics.latency(yar::db::operation::update, yar::db::stage::match).collect().count >= 1u);
+            require_true(metrics.latency(yar::db::operation::destroy, yar::db::stage::index).collect().count >= 1u);
+
+            // The secondary index finds the one document, nothing else is decoded
+            auto out = yar::db::exposition{};
+            engine.expose(out);
+            const auto& text = out.str();
+            require_true(text.contains("yardb_collection_scanned_total{collection=\"Metrics\"} 1\n"s));
+            require_true(text.contains("yardb_collection_returned_total{collection=\"Metrics\"} 1\n"s));
+            require_true(text.contains("yardb_collection_scanned_per_returned{collection=\"Metrics\"} 1\n"s));
+            require_true(text.contains("yardb_index_entries{collection=\"Metrics\",index=\"_id\"} 3\n"s));
+            require_true(text.contains("yardb_index_entries{collection=\"Metrics\",index=\"N\"} 3\n"s));
+            require_true(text.contains("yardb_log_bytes "s));
+            require_true(text.contains("yardb_cache_hits_total "s));
+        };
     };
+
+    test_case("engine write throughput by durability level, [benchmark]") = []
+    {
+        const auto test_file = "./engine_bench.db";
+        const auto setup = fixture{test_file};
+        const auto writes = 2000;
+        auto engine = yar::db::engine{test_file};
+        auto engine_lock = mutex{};
+
+        // Writes per second of the given write loop
+        auto rate = [writes](auto write)
+        {
+            const auto start = chrono::steady_clock::now();
+            write();
+            const auto elapsed = chrono::duration<double>{chrono::steady_clock::now() - start};
+            return writes / elapsed.count();
+        };
+
+        for(auto [name, level] : {pair{"none"s, yar::db::durability::none},
+                                  pair{"flush"s, yar::db::durability::flush},
+                                  pair{"fsync"s, yar::db::durability::fsync}})
+        {
+            engine.collection("Bench"s + name);
+            const auto sequential = rate([&]
+            {
+                for(auto i = 0; i < writes; ++i)
+                {
+                    auto document = object{{"N"s, i}, {"Text"s, "some text to encode"s}};
+                    engine.create(document, level);
+                }
+            });
+            clog << "Write benchmark durability=" << name << " sequential=" << static_cast<long long>(sequential) << "/s" << endl;
+            require_true(sequential > 0.0);
+        }
+
+        // Concurrent writers append under the engine lock and wait for the sync after releasing it
+        const auto threads = 8;
+        engine.collection("BenchGroup"s);
+        const auto group = rate([&]
+        {
+            auto workers = vector<jthread>{};
+            for(auto t = 0; t < threads; ++t)
+                workers.emplace_back([&]
+                {
+                    for(auto i = 0; i < writes / threads; ++i)
+                    {
+                        auto document = object{{"N"s, i}, {"Text"s, "some text to encode"s}};
+                        {
+                            const auto guard = lock_guard{engine_lock};
+                            engine.create(document, yar::db::durability::flush);
+                        }
+                        engine.sync();
+                    }
+                });
+        });
+        clog << "Write benchmark durability=fsync group_commit threads=" << threads << " rate=" << static_cast<long long>(group) << "/s" << endl;
+        require_true(group > 0.0);
+
+        // Batches are appended, written out and synced once
+        const auto batch_size = 100;
+        engine.collection("BenchBatch"s);
+        const auto batched = rate([&]
+        {
+            for(auto b = 0; b < writes / batch_size; ++b)
+            {
+                auto batch = object::array{};
+                for(auto i = 0; i < batch_size; ++i)
+                    batch.push_back(object{{"N"s, i}, {"Text"s, "some text to encode"s}});
+                engine.create(batch, yar::db::durability::fsync);
+            }
+        });
+        clog << "Write benchmark durability=fsync batch=" << batch_size << " rate=" << static_cast<long long>(batched) << "/s" << endl;
+        require_true(batched > 0.0);
+    };
+
     return true;
 }
 
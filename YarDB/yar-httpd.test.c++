@@ -26,6 +26,8 @@ public:
         // Clean up any stale PID file from previous test runs
         const auto pid_file = string{file} + ".pid"s;
         remove(pid_file.c_str());
+        const auto idx_file = string{file} + ".idx"s;
+        remove(idx_file.c_str());
         
         auto fs = fstream{};
         fs.open(file, ios::out);
@@ -46,6 +48,9 @@ public:
         // Also remove the PID lock file
         const auto pid_file = file + ".pid"s;
         remove(pid_file.c_str());
+        // And the index checkpoint
+        const auto idx_file = file + ".idx"s;
+        remove(idx_file.c_str());
     }
     
 private:
@@ -307,6 +312,60 @@ auto test_set()
             require_true(error.has("message"s));
         };
 
+        section("POST with a JSON array creates every document as one batch") = [setup]
+        {
+            auto [status, reason, headers, response_body] = make_request(
+                setup->port(), "POST"s, "/batchitems"s, R"([{"name":"First"},{"name":"Second"},{"name":"Third"}])"s
+            );
+
+            require_eq(status, "201"s);
+            require_eq(reason, "Created"s);
+            
+            // Every created document gets its own _id
+            auto documents = json::parse(response_body);
+            require_true(documents.is_array());
+            const auto& items = documents.get<object::array>();
+            require_eq(items.size(), 3u);
+            for(const auto& item : items)
+                require_true(item.has("_id"s));
+            
+            auto [get_status, get_reason, get_headers, get_body] = make_request(
+                setup->port(), "GET"s, "/batchitems"s, ""s
+            );
+            require_eq(get_status, "200"s);
+            require_eq(json::parse(get_body).get<object::array>().size(), 3u);
+
+            // A batch with an element that is not an object is rejected as a whole
+            auto [bad_status, bad_reason, bad_headers, bad_body] = make_request(
+                setup->port(), "POST"s, "/batchitems"s, R"([{"name":"Fourth"},5])"s
+            );
+            require_eq(bad_status, "400"s);
+            auto [after_status, after_reason, after_headers, after_body] = make_request(
+                setup->port(), "GET"s, "/batchitems"s, ""s
+            );
+            require_eq(json::parse(after_body).get<object::array>().size(), 3u);
+        };
+
+        section("POST with x-durability fsync returns 201 Created") = [setup]
+        {
+            auto [status, reason, headers, response_body] = make_request_with_headers(
+                setup->port(), "POST"s, "/testitems"s, {{"X-Durability", "fsync"}}, R"({"name":"Durable Item"})"s
+            );
+
+            require_eq(status, "201"s);
+            require_true(headers.contains("location"));
+        };
+
+        section("POST with unknown x-durability returns 400 Bad Request") = [setup]
+        {
+            auto [status, reason, headers, response_body] = make_request_with_headers(
+                setup->port(), "POST"s, "/testitems"s, {{"X-Durability", "eventually"}}, R"({"name":"Item"})"s
+            );
+
+            require_eq(status, "400"s);
+            require_eq(reason, "Bad Request"s);
+        };
+
         section("PUT updates document and returns 200 OK with Content-Location header") = [setup]
         {
             // First create a document
@@ -393,6 +452,90 @@ auto test_set()
             const string content_location = headers["content-location"s];
             require_eq(content_location, "/testitems/"s + std::to_string(id));
         };
+
+        section("GET /_cache counts repeated reads of a document as hits") = [setup]
+        {
+            auto [post_status, post_reason, post_headers, post_body] = make_request(
+                setup->port(), "POST"s, "/cached"s, R"({"value":1})"s
+            );
+            require_eq(post_status, "201"s);
+            const auto id = std::to_string(static_cast<xson::integer_type>(json::parse(post_body)["_id"s]));
+
+            auto [before_status, before_reason, before_headers, before_body] = make_request(setup->port(), "GET"s, "/_cache"s, ""s);
+            require_eq(before_status, "200"s);
+            const auto hits = static_cast<xson::integer_type>(json::parse(before_body)["hits"s]);
+
+            // The document and its ETag and Last-Modified lookups are decoded once
+            for(auto i = 0; i < 3; ++i)
+            {
+                auto [status, reason, headers, body] = make_request(setup->port(), "GET"s, "/cached/"s + id, ""s);
+                require_eq(status, "200"s);
+            }
+
+            auto [status, reason, headers, response_body] = make_request(setup->port(), "GET"s, "/_cache"s, ""s);
+            require_eq(status, "200"s);
+            auto result = json::parse(response_body);
+            require_true(static_cast<xson::integer_type>(result["hits"s]) >= hits + 8);
+            require_true(static_cast<xson::integer_type>(result["bytes"s]) <= static_cast<xson::integer_type>(result["capacity_bytes"s]));
+        };
+
+        section("GET /_metrics exposes engine and route metrics in Prometheus text format") = [setup]
+        {
+            auto [post_status, post_reason, post_headers, post_body] = make_request(
+                setup->port(), "POST"s, "/measured"s, R"({"value":1})"s
+            );
+            require_eq(post_status, "201"s);
+            auto [get_status, get_reason, get_headers, get_body] = make_request(setup->port(), "GET"s, "/measured"s, ""s);
+            require_eq(get_status, "200"s);
+
+            // Scrapers do not ask for JSON
+            auto [status, reason, headers, body] = make_request_with_accept(
+                setup->port(), "GET"s, "/_metrics"s, "text/plain;version=0.0.4;q=0.5,*/*;q=0.1"s
+            );
+            require_eq(status, "200"s);
+            require_true(headers.contains("content-type"s));
+            const string content_type = headers["content-type"s];
+            require_true(content_type.starts_with("text/plain"s));
+
+            require_true(body.contains("# TYPE yardb_engine_operation_seconds histogram\n"s));
+            require_true(body.contains("yardb_engine_stage_seconds_count{operation=\"create\",stage=\"write\"} "s));
+            require_true(body.contains("yardb_collection_returned_total{collection=\"measured\"} 1\n"s));
+            require_true(body.contains("yardb_index_entries{collection=\"measured\",index=\"_id\"} 1\n"s));
+            require_true(body.contains("yardb_log_bytes "s));
+            require_true(body.contains("yardb_http_request_seconds_bucket{route=\"POST_DOCUMENT\",le=\"+Inf\"} "s));
+            require_true(body.contains("yardb_http_handler_seconds_count{route=\"GET_COLLECTION\"} "s));
+            require_true(body.contains("yardb_http_responses_total{route=\"POST_DOCUMENT\",code=\"2xx\"} "s));
+
+            // The POST waited for the engine lock, however briefly
+            require_true(body.contains("# TYPE yardb_http_engine_lock_wait_seconds histogram\n"s));
+            require_false(body.contains("yardb_http_engine_lock_wait_seconds_count 0\n"s));
+        };
+
+        section("GET /_compact drops superseded versions and keeps documents readable") = [setup]
+        {
+            auto [post_status, post_reason, post_headers, post_body] = make_request(
+                setup->port(), "POST"s, "/compacted"s, R"({"value":1})"s
+            );
+            require_eq(post_status, "201"s);
+            const auto id = std::to_string(static_cast<xson::integer_type>(json::parse(post_body)["_id"s]));
+            for(auto value : {2, 3, 4})
+            {
+                auto [status, reason, headers, body] = make_request(
+                    setup->port(), "PATCH"s, "/compacted/"s + id, R"({"value":)"s + std::to_string(value) + "}"s
+                );
+                require_eq(status, "200"s);
+            }
+
+            auto [status, reason, headers, response_body] = make_request(setup->port(), "GET"s, "/_compact"s, ""s);
+            require_eq(status, "200"s);
+            auto result = json::parse(response_body);
+            require_true(static_cast<xson::integer_type>(result["after_bytes"s]) < static_cast<xson::integer_type>(result["before_bytes"s]));
+            require_true(static_cast<xson::integer_type>(result["kept"s]) < static_cast<xson::integer_type>(result["records"s]));
+
+            auto [get_status, get_reason, get_headers, get_body] = make_request(setup->port(), "GET"s, "/compacted/"s + id, ""s);
+            require_eq(get_status, "200"s);
+            require_eq(static_cast<xson::integer_type>(json::parse(get_body)["value"s]), 4ll);
+        };
     };
 
     test_case("OData query parameters, [yardb]") = []
@@ -609,6 +752,49 @@ auto test_set()
             }
         };
 
+        section("GET with $top pages with continuation tokens") = [setup]
+        {
+            for(int i = 1; i <= 7; ++i)
+            {
+                auto [post_status, post_reason, post_headers, post_body] = make_request(
+                    setup->port(), "POST"s, "/pageditems"s, R"({"value":)"s + std::to_string(i) + "}"s
+                );
+                require_eq(post_status, "201"s);
+            }
+
+            // Follow x-continuation-token until the collection is exhausted
+            auto values = std::vector<xson::integer_type>{};
+            auto path = "/pageditems?$top=3"s;
+            for(auto page = 0; page < 5; ++page)
+            {
+                auto [status, reason, headers, response_body] = make_request(setup->port(), "GET"s, path, ""s);
+                require_eq(status, "200"s);
+                auto documents = json::parse(response_body);
+                require_true(documents.is_array());
+                for(const auto& item : documents.get<object::array>())
+                    values.push_back(static_cast<xson::integer_type>(item["value"s]));
+                if(!headers.contains("x-continuation-token"s))
+                    break;
+                path = "/pageditems?$top=3&$skiptoken="s + string{headers["x-continuation-token"s]};
+            }
+            require_true(values == std::vector<xson::integer_type>{1, 2, 3, 4, 5, 6, 7});
+
+            // With metadata the next page is linked from the response
+            auto [status, reason, headers, response_body] = make_request_with_accept(
+                setup->port(), "GET"s, "/pageditems?$top=5"s, "application/json;odata=minimalmetadata"s
+            );
+            require_eq(status, "200"s);
+            auto response = json::parse(response_body);
+            require_eq(response["value"s].get<object::array>().size(), 5uz);
+            require_true(response["@odata.nextLink"s].get<string>().starts_with("/pageditems?$top=5&$skiptoken="s));
+
+            // A malformed token is rejected
+            auto [bad_status, bad_reason, bad_headers, bad_body] = make_request(
+                setup->port(), "GET"s, "/pageditems?$top=3&$skiptoken=xyz"s, ""s
+            );
+            require_eq(bad_status, "422"s);
+        };
+
         section("GET with $skip=0 should return all items") = [setup]
         {
             // Create multiple documents
@@ -1299,6 +1485,26 @@ auto test_set()
             // Response should be "0"
             require_eq(response_body, "0"s);
         };
+
+        section("GET with $explain=true returns the query plan") = [setup]
+        {
+            // Explain a filtered read instead of returning its documents
+            auto [status, reason, headers, response_body] = make_request(
+                setup->port(), "GET"s, "/users3?$filter=contains(email,'@example')&$explain=true"s, ""s
+            );
+
+            require_eq(status, "200"s);
+            require_eq(reason, "OK"s);
+            
+            auto plan = json::parse(response_body);
+            require_true(plan.is_object());
+            require_eq(static_cast<string>(plan["access"s]), "primary_scan"s);
+            require_eq(static_cast<string>(plan["ordering"s]), "index_order"s);
+            require_true(plan.has("scanned"s));
+            
+            // The string filter is evaluated by the engine (Alice and Charlie)
+            require_true(static_cast<xson::integer_type>(plan["returned"s]) >= 2);
+        };
     };
 
     test_case("PUT and PATCH /_db/{collection_name} - Add secondary indexes, [yardb]") = []
@@ -1415,6 +1621,46 @@ auto test_set()
             require_eq(items[0]["email"s].get<string>(), "user1@test.com"s);
         };
 
+        section("PUT /_db/{collection_name} declares compound and non-unique indexes") = [setup]
+        {
+            for(const auto* body : {R"({"customer_id":7,"status":"open","total":10})",
+                                    R"({"customer_id":7,"status":"open","total":25})",
+                                    R"({"customer_id":8,"status":"open","total":5})"})
+            {
+                auto [post_status, _unused1, _unused2, _unused3] = make_request(setup->port(), "POST"s, "/compoundtest"s, string{body});
+                require_eq(post_status, "201"s);
+            }
+
+            auto [put_status, _unused4, _unused5, put_body] = make_request(
+                setup->port(), "PUT"s, "/_db/compoundtest"s, R"({"keys":["status",["customer_id","total"]]})"s
+            );
+            require_eq(put_status, "200"s);
+            const auto keys = json::parse(put_body)["keys"s].get<object::array>();
+            require_eq(keys.size(), 2u);
+
+            // Every document sharing the indexed value is returned
+            auto [get_status1, _unused6, _unused7, get_body1] = make_request(
+                setup->port(), "GET"s, "/compoundtest?$filter=status%20eq%20'open'"s, ""s
+            );
+            require_eq(get_status1, "200"s);
+            require_eq(json::parse(get_body1).get<object::array>().size(), 3u);
+
+            // Served from the compound index
+            auto [get_status2, _unused8, _unused9, get_body2] = make_request(
+                setup->port(), "GET"s, "/compoundtest?$filter=customer_id%20eq%207%20and%20total%20gt%2010"s, ""s
+            );
+            require_eq(get_status2, "200"s);
+            const auto items = json::parse(get_body2).get<object::array>();
+            require_eq(items.size(), 1u);
+            require_eq(static_cast<xson::integer_type>(items[0]["total"s]), 25ll);
+
+            // Compound declarations must be arrays of strings
+            auto [bad_status, _unused10, _unused11, _unused12] = make_request(
+                setup->port(), "PUT"s, "/_db/compoundtest"s, R"({"keys":[["customer_id",1]]})"s
+            );
+            require_eq(bad_status, "400"s);
+        };
+
         section("PATCH /_db/{collection_name} adds indexes incrementally") = [setup]
         {
             // First, add some indexes with PUT
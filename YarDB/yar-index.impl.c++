@@ -6,14 +6,66 @@ namespace {
 
 auto make_primary_key   = [](const xson::primitive& v){return std::get<xson::integer_type>(v);};
 
-auto make_secondary_key = [](const xson::primitive& v){return xson::to_string(v);};
+// Rank of a primitive's kind in the secondary key ordering, integers and doubles share a rank
+auto kind = [](const xson::primitive& v)
+{
+    if(std::holds_alternative<std::monostate>(v))       return 0;
+    if(std::holds_alternative<xson::boolean_type>(v))   return 1;
+    if(std::holds_alternative<xson::integer_type>(v))   return 2;
+    if(std::holds_alternative<xson::number_type>(v))    return 2;
+    if(std::holds_alternative<xson::string_type>(v))    return 3;
+    if(std::holds_alternative<xson::timestamp_type>(v)) return 4;
+    std::unreachable();
+};
 
-template <typename T, typename F>
-yar::db::index_view query_analysis(const yar::db::object& selector, const T& keys, F make_key)
+auto as_number = [](const xson::primitive& v)
+{
+    if(std::holds_alternative<xson::integer_type>(v))
+        return static_cast<xson::number_type>(std::get<xson::integer_type>(v));
+    return std::get<xson::number_type>(v);
+};
+
+auto less = [](const xson::primitive& a, const xson::primitive& b)
+{
+    if(kind(a) != kind(b))
+        return kind(a) < kind(b);
+    if(std::holds_alternative<xson::integer_type>(a) && std::holds_alternative<xson::integer_type>(b))
+        return std::get<xson::integer_type>(a) < std::get<xson::integer_type>(b);
+    if(kind(a) == 2)
+        return as_number(a) < as_number(b);
+    return a < b;
+};
+
+// Secondary key of the given fields, empty if the document lacks the leading one
+// Missing trailing fields of a compound index are keyed as null, so a lookup on a prefix of the
+// fields finds every document with that prefix
+auto make_document_key(const yar::db::object& document, const std::vector<std::string>& fields)
+{
+    auto key = yar::db::secondary_key_type{};
+    if(!document.has(fields.front()))
+        return key;
+    for(const auto& field : fields)
+        if(document.has(field))
+            key.push_back(document[field]);
+        else
+            key.emplace_back();
+    return key;
+}
+
+// Split a comma separated compound index name into its fields
+auto split_fields(const std::string& name)
 {
-    auto begin = std::ranges::cbegin(keys),
-         end   = std::ranges::cend(keys);
+    auto fields = std::vector<std::string>{};
+    for(const auto field : std::views::split(name, ','))
+        fields.emplace_back(std::ranges::begin(field), std::ranges::end(field));
+    return fields;
+}
 
+// Narrow [begin, end) of keys down to the entries the selector asks for
+template <typename T, typename F>
+yar::db::index_view query_analysis(const yar::db::object& selector, const T& keys, F make_key,
+                                   typename T::const_iterator begin, typename T::const_iterator end)
+{
     if(selector.has("$gt"s))
     {
         const auto key = make_key(selector["$gt"s]);
@@ -55,24 +107,219 @@ yar::db::index_view query_analysis(const yar::db::object& selector, const T& key
         std::ranges::advance(itr, std::min<xson::integer_type>(n, keys.size()));
         begin = itr.base();
     }
-    else // if(std::holds_alternative<typename T::mapped_type>((db::object::primitive)selector)) // FIXME
+    else if(!selector.is_object()) // Plain value, i.e. equality
     {
         const auto key = make_key(selector);
         std::tie(begin,end) = keys.equal_range(key);
     }
 
+    // An empty or inverted range such as {$gt: 9, $lt: 1}
+    if(begin == std::ranges::cend(keys) || end == std::ranges::cbegin(keys) ||
+       (begin != end && keys.key_comp()(std::prev(end)->first, begin->first)))
+        end = begin;
+
     if(!selector.has("$desc"s))
         return {begin, end};
     else
         return {std::make_reverse_iterator(end), std::make_reverse_iterator(begin)};
 }
 
+template <typename T, typename F>
+yar::db::index_view query_analysis(const yar::db::object& selector, const T& keys, F make_key)
+{
+    return query_analysis(selector, keys, make_key, std::ranges::cbegin(keys), std::ranges::cend(keys));
+}
+
+// Walk the fields of a (compound) secondary index: leading fields compared for equality form a key
+// prefix, the first field with operators (or the last field present) is analysed as a range
+yar::db::index_view secondary_query_analysis(const yar::db::object& selector, const yar::db::secondary_index& index)
+{
+    auto prefix = yar::db::secondary_key_type{};
+    for(const auto& field : index.fields)
+    {
+        if(!selector.has(field))
+            break;
+
+        const auto value = selector[field];
+        if(value.is_object() || prefix.size() + 1 == index.fields.size())
+        {
+            auto make_key = [&prefix](const xson::primitive& v)
+            {
+                auto key = prefix;
+                key.push_back(v);
+                return key;
+            };
+            // Ranges on this field stay within the entries sharing the equality prefix
+            const auto [begin, end] = index.keys.equal_range(prefix);
+            return query_analysis(value, index.keys, make_key, begin, end);
+        }
+        prefix.push_back(value);
+    }
+
+    const auto [begin, end] = index.keys.equal_range(prefix);
+    return {begin, end};
+}
+
+// Views larger than this are not counted to the end, their estimate is capped
+constexpr auto estimate_limit = std::size_t{1} << 16;
+
+auto count(const yar::db::index_view& view, std::size_t limit = estimate_limit)
+{
+    auto n = 0uz;
+    for(auto itr = view.begin(), end = view.end(); itr != end && n < limit; ++itr)
+        ++n;
+    return n;
+}
+
+// True if the selector compares every field of the index for equality
+auto full_key_equality(const yar::db::object& selector, const yar::db::secondary_index& index)
+{
+    for(const auto& field : index.fields)
+    {
+        if(!selector.has(field))
+            return false;
+        const auto value = selector[field];
+        if(value.is_object() && !value.has("$eq"s))
+            return false;
+    }
+    return true;
+}
+
+// Number of distinct keys in a secondary index
+auto count_distinct(const yar::db::secondary_index_type& keys)
+{
+    auto n = 0uz;
+    for(auto itr = keys.begin(); itr != keys.end(); itr = keys.upper_bound(itr->first))
+        ++n;
+    return n;
+}
+
+// Primitives are encoded as their variant index followed by the value
+void encode_primitive(std::ostream& os, const xson::primitive& value)
+{
+    xson::fast::encode(os, static_cast<std::int64_t>(value.index()));
+    std::visit([&os](const auto& v)
+    {
+        using T = std::decay_t<decltype(v)>;
+        if constexpr(std::same_as<T, std::monostate>)
+            return;
+        else if constexpr(std::same_as<T, xson::boolean_type>)
+            xson::fast::encode(os, std::int64_t{v ? 1 : 0});
+        else if constexpr(std::same_as<T, xson::number_type>)
+            xson::fast::encode(os, std::bit_cast<std::int64_t>(v));
+        else
+            xson::fast::encode(os, v);
+    }, value);
+}
+
+template<typename T>
+T decode_alternative(std::istream& is)
+{
+    if constexpr(std::same_as<T, std::monostate>)
+        return T{};
+    else if constexpr(std::same_as<T, xson::boolean_type>)
+    {
+        auto v = std::int64_t{};
+        xson::fast::decode(is, v);
+        return v != 0;
+    }
+    else if constexpr(std::same_as<T, xson::number_type>)
+    {
+        auto v = std::int64_t{};
+        xson::fast::decode(is, v);
+        return std::bit_cast<xson::number_type>(v);
+    }
+    else
+    {
+        auto v = T{};
+        xson::fast::decode(is, v);
+        return v;
+    }
+}
+
+auto decode_primitive(std::istream& is)
+{
+    auto tag = std::int64_t{};
+    xson::fast::decode(is, tag);
+
+    auto value = xson::primitive{};
+    const auto decoded = [&]<std::size_t... I>(std::index_sequence<I...>)
+    {
+        return ((tag == I ? (value.emplace<I>(decode_alternative<std::variant_alternative_t<I, xson::primitive>>(is)), true) : false) || ...);
+    }(std::make_index_sequence<std::variant_size_v<xson::primitive>>{});
+
+    if(!decoded)
+        is.setstate(std::ios::failbit);
+    return value;
+}
+
+// Order of two iterators into the same map by key, the end last
+template <typename T>
+bool before(const T& keys, typename T::const_iterator a, typename T::const_iterator b)
+{
+    if(a == std::ranges::cend(keys))
+        return false;
+    if(b == std::ranges::cend(keys))
+        return true;
+    return keys.key_comp()(a->first, b->first);
+}
+
+// Keep an iterator within [low, high]
+template <typename T>
+auto clamp(const T& keys, typename T::const_iterator itr, typename T::const_iterator low, typename T::const_iterator high)
+{
+    if(before(keys, itr, low))
+        itr = low;
+    if(before(keys, high, itr))
+        itr = high;
+    return itr;
+}
+
+// Entry holding the key and position, or the end of the key's entries if it is gone
+template <typename T, typename K>
+auto find_entry(const T& keys, const K& key, yar::db::position_type position)
+{
+    auto [begin, end] = keys.equal_range(key);
+    for(auto itr = begin; itr != end; ++itr)
+        if(itr->second == position)
+            return std::pair{itr, true};
+    return std::pair{end, false};
+}
+
 } // namespace
 
+void yar::db::encode_key(std::ostream& os, const yar::db::secondary_key_type& key)
+{
+    xson::fast::encode(os, static_cast<std::int64_t>(key.size()));
+    for(const auto& value : key)
+        encode_primitive(os, value);
+}
+
+yar::db::secondary_key_type yar::db::decode_key(std::istream& is)
+{
+    auto parts = std::int64_t{};
+    xson::fast::decode(is, parts);
+    auto key = yar::db::secondary_key_type{};
+    for(auto k = 0ll; k < parts && is; ++k)
+        key.push_back(decode_primitive(is));
+    return key;
+}
+
+bool yar::db::secondary_key_less::operator()(const yar::db::secondary_key_type& a, const yar::db::secondary_key_type& b) const
+{
+    const auto n = std::min(a.size(), b.size());
+    for(auto i = 0uz; i < n; ++i)
+    {
+        if(less(a[i], b[i])) return true;
+        if(less(b[i], a[i])) return false;
+    }
+    return false;
+}
+
 void yar::db::index::add(const std::string& key)
 {
     if(not m_secondary_keys.contains(key))
-        m_secondary_keys[key] = yar::db::secondary_index_type{};
+        m_secondary_keys[key] = yar::db::secondary_index{split_fields(key), yar::db::secondary_index_type{}};
 }
 
 void yar::db::index::add(std::vector<std::string> keys)
@@ -97,7 +344,7 @@ bool yar::db::index::primary_key(const yar::db::object& selector) const
 bool yar::db::index::secondary_key(const yar::db::object& selector) const
 {
     for(const auto& [name,key] : m_secondary_keys)
-        if(selector.has(name))
+        if(selector.has(key.fields.front()))
             return true;
     return false;
 }
@@ -108,9 +355,23 @@ yar::db::index_view yar::db::index::view(const yar::db::object& selector) const
         return query_analysis(selector["_id"s], m_primary_keys, make_primary_key);
 
     else if(secondary_key(selector))
+    {
+        // Prefer the index covering the most selector fields in order
+        const yar::db::secondary_index* best = nullptr;
+        auto best_covered = 0uz;
         for(const auto& [name,key] : m_secondary_keys)
-            if(selector.has(name))
-                return query_analysis(selector[name], key, make_secondary_key);
+        {
+            auto covered = 0uz;
+            while(covered < key.fields.size() && selector.has(key.fields[covered]))
+                ++covered;
+            if(covered > best_covered)
+            {
+                best = &key;
+                best_covered = covered;
+            }
+        }
+        return secondary_query_analysis(selector, *best);
+    }
 
     // else
 
@@ -120,6 +381,104 @@ yar::db::index_view yar::db::index::view(const yar::db::object& selector) const
         return {std::ranges::crbegin(m_primary_keys),std::ranges::crend(m_primary_keys)};
 }
 
+std::optional<yar::db::index_view> yar::db::index::resume(const std::string& name, const yar::db::index_view& view, const yar::db::secondary_key_type& key, yar::db::position_type position) const
+{
+    const auto begin = view.begin(), end = view.end();
+
+    // A reverse view walks the forward range [end.base(), begin.base()) backwards, so it continues
+    // with the entries before the last one
+    if(name == "_id"s)
+    {
+        if(key.size() != 1 || !std::holds_alternative<xson::integer_type>(key.front()))
+            return std::nullopt;
+        const auto pk = make_primary_key(key.front());
+        const auto& keys = m_primary_keys;
+        switch(begin.c_index_type)
+        {
+        case yar::db::index_iterator::primary:
+            return yar::db::index_view{clamp(keys, keys.upper_bound(pk), begin.m_primary_current, end.m_primary_current),
+                                       end.m_primary_current};
+        case yar::db::index_iterator::reverse_primary:
+        {
+            const auto next = clamp(keys, keys.lower_bound(pk), end.m_reverse_primary_current.base(), begin.m_reverse_primary_current.base());
+            return yar::db::index_view{std::make_reverse_iterator(next), end.m_reverse_primary_current};
+        }
+        default:
+            return std::nullopt;
+        }
+    }
+
+    const auto it = m_secondary_keys.find(name);
+    if(it == m_secondary_keys.end())
+        return std::nullopt;
+    const auto& keys = it->second.keys;
+    const auto [entry, found] = find_entry(keys, key, position);
+    switch(begin.c_index_type)
+    {
+    case yar::db::index_iterator::secondary:
+        return yar::db::index_view{clamp(keys, found ? std::next(entry) : entry, begin.m_secondary_current, end.m_secondary_current),
+                                   end.m_secondary_current};
+    case yar::db::index_iterator::reverse_secondary:
+    {
+        const auto next = clamp(keys, found ? entry : keys.lower_bound(key), end.m_reverse_secondary_current.base(), begin.m_reverse_secondary_current.base());
+        return yar::db::index_view{std::make_reverse_iterator(next), end.m_reverse_secondary_current};
+    }
+    default:
+        return std::nullopt;
+    }
+}
+
+std::vector<yar::db::index_candidate> yar::db::index::candidates(const yar::db::object& selector) const
+{
+    auto result = std::vector<yar::db::index_candidate>{};
+
+    if(primary_key(selector))
+    {
+        const auto view = query_analysis(selector["_id"s], m_primary_keys, make_primary_key);
+        result.emplace_back("_id"s, view, count(view), m_primary_keys.size());
+    }
+
+    for(const auto& [name,key] : m_secondary_keys)
+    {
+        if(!selector.has(key.fields.front()))
+            continue;
+
+        const auto view = secondary_query_analysis(selector, key);
+        // Average number of entries per key when the whole key is compared for equality
+        const auto estimate = !full_key_equality(selector, key) ? count(view)
+                            : key.distinct == 0                 ? 0uz
+                            : (key.keys.size() + key.distinct - 1) / key.distinct;
+        result.emplace_back(name, view, estimate, key.keys.size());
+    }
+
+    return result;
+}
+
+std::optional<yar::db::index_candidate> yar::db::index::ordered(const std::string& field, const yar::db::object& selector, bool descending) const
+{
+    for(const auto& [name,key] : m_secondary_keys)
+    {
+        if(key.fields.front() != field)
+            continue;
+        if(!selector.has(field) && key.keys.size() < m_primary_keys.size())
+            continue;
+
+        // Analyse the leading field alone, with the walk direction attached to its predicate
+        auto predicate = yar::db::object{};
+        if(selector.has(field) && selector[field].is_object())
+            predicate = selector[field];
+        else if(selector.has(field))
+            predicate["$eq"s] = selector[field];
+        if(descending)
+            predicate["$desc"s] = true;
+
+        auto make_key = [](const xson::primitive& v){return yar::db::secondary_key_type{v};};
+        const auto view = query_analysis(predicate, key.keys, make_key);
+        return yar::db::index_candidate{name, view, count(view), key.keys.size()};
+    }
+    return std::nullopt;
+}
+
 void yar::db::index::update(yar::db::object& document)
 {
     if(document.has("_id"s))
@@ -128,28 +487,196 @@ void yar::db::index::update(yar::db::object& document)
         document["_id"s] = ++m_sequence;
 }
 
-void yar::db::index::insert(yar::db::object& document, yar::db::position_type position)
+void yar::db::index::insert(yar::db::object& document, yar::db::position_type position,
+                            const std::function<bool(yar::db::position_type, yar::db::object&)>& superseded)
 {
+    // The superseded version is found under its own keys, not the ones of the new document
     const auto pk = make_primary_key(document["_id"s]);
+    if(const auto it = m_primary_keys.find(pk); it != m_primary_keys.end())
+    {
+        auto previous = yar::db::object{};
+        if(superseded && superseded(it->second, previous))
+            erase(previous, it->second);
+        else
+            erase(it->second);
+    }
     m_primary_keys[pk] = position;
 
     for(auto& [name,key] : m_secondary_keys)
-        if(document.has(name))
-        {
-            const auto sk = make_secondary_key(document[name]);
-            key[sk] = position;
-        }
+    {
+        auto sk = make_document_key(document, key.fields);
+        if(sk.empty())
+            continue;
+        if(!key.keys.contains(sk))
+            ++key.distinct;
+        key.keys.emplace(std::move(sk), position);
+    }
 }
 
 void yar::db::index::erase(const yar::db::object& document)
 {
     const auto pk = make_primary_key(document["_id"s]);
-    m_primary_keys.erase(pk);
+    if(const auto it = m_primary_keys.find(pk); it != m_primary_keys.end())
+    {
+        erase(document, it->second);
+        m_primary_keys.erase(it);
+    }
+}
 
+void yar::db::index::erase(const yar::db::object& document, yar::db::position_type position)
+{
     for(auto& [name,key] : m_secondary_keys)
-        if(document.has(name))
+    {
+        const auto sk = make_document_key(document, key.fields);
+        if(sk.empty())
+            continue;
+        auto erased = false;
+        auto [begin, end] = key.keys.equal_range(sk);
+        while(begin != end)
+            if(begin->second == position)
+            {
+                begin = key.keys.erase(begin);
+                erased = true;
+            }
+            else
+                ++begin;
+        if(erased && !key.keys.contains(sk))
+            --key.distinct;
+    }
+}
+
+void yar::db::index::erase(yar::db::position_type position)
+{
+    for(auto& [name,key] : m_secondary_keys)
+        if(std::erase_if(key.keys, [position](const auto& entry){ return entry.second == position; }) > 0)
+            key.distinct = count_distinct(key.keys);
+}
+
+void yar::db::index::clear()
+{
+    m_primary_keys.clear();
+    for(auto& [name,key] : m_secondary_keys)
+    {
+        key.keys.clear();
+        key.distinct = 0;
+    }
+}
+
+void yar::db::index::retain(const std::function<bool(yar::db::position_type)>& live)
+{
+    auto stale = std::set<yar::db::position_type>{};
+    std::erase_if(m_primary_keys, [&](const auto& entry)
+    {
+        if(live(entry.second))
+            return false;
+        stale.insert(entry.second);
+        return true;
+    });
+
+    if(stale.empty())
+        return;
+
+    for(auto& [name,key] : m_secondary_keys)
+    {
+        std::erase_if(key.keys, [&stale](const auto& entry){return stale.contains(entry.second);});
+        key.distinct = count_distinct(key.keys);
+    }
+}
+
+void yar::db::index::remap(const std::function<std::optional<yar::db::position_type>(yar::db::position_type)>& moved)
+{
+    auto relocated = std::map<yar::db::position_type, yar::db::position_type>{};
+    retain([&](yar::db::position_type position)
+    {
+        const auto to = moved(position);
+        if(to)
+            relocated.emplace(position, *to);
+        return to.has_value();
+    });
+
+    for(auto& [pk, position] : m_primary_keys)
+        position = relocated[position];
+
+    // Secondary entries not backed by a relocated primary entry are stale and dropped, so remapping
+    // cannot fail half way once the log has been replaced
+    for(auto& [name,key] : m_secondary_keys)
+    {
+        for(auto it = key.keys.begin(); it != key.keys.end();)
+            if(const auto to = relocated.find(it->second); to != relocated.end())
+            {
+                it->second = to->second;
+                ++it;
+            }
+            else
+                it = key.keys.erase(it);
+        key.distinct = count_distinct(key.keys);
+    }
+}
+
+void yar::db::index::save(std::ostream& os) const
+{
+    xson::fast::encode(os, static_cast<std::int64_t>(m_sequence));
+
+    xson::fast::encode(os, static_cast<std::int64_t>(m_primary_keys.size()));
+    for(const auto& [pk, position] : m_primary_keys)
+    {
+        xson::fast::encode(os, static_cast<std::int64_t>(pk));
+        xson::fast::encode(os, static_cast<std::int64_t>(position));
+    }
+
+    xson::fast::encode(os, static_cast<std::int64_t>(m_secondary_keys.size()));
+    for(const auto& [name,key] : m_secondary_keys)
+    {
+        xson::fast::encode(os, name);
+        xson::fast::encode(os, static_cast<std::int64_t>(key.keys.size()));
+        for(const auto& [sk, position] : key.keys)
         {
-            const auto sk = make_secondary_key(document[name]);
-            key.erase(sk);
+            yar::db::encode_key(os, sk);
+            xson::fast::encode(os, static_cast<std::int64_t>(position));
         }
+    }
+}
+
+bool yar::db::index::load(std::istream& is)
+{
+    auto sequence = std::int64_t{}, count = std::int64_t{};
+    auto primary_keys = yar::db::primary_index_type{};
+    auto secondary_keys = yar::db::secondary_index_map{};
+
+    xson::fast::decode(is, sequence);
+
+    xson::fast::decode(is, count);
+    for(auto i = 0ll; i < count && is; ++i)
+    {
+        auto pk = std::int64_t{}, position = std::int64_t{};
+        xson::fast::decode(is, pk);
+        xson::fast::decode(is, position);
+        primary_keys.emplace_hint(primary_keys.end(), pk, position);
+    }
+
+    xson::fast::decode(is, count);
+    for(auto i = 0ll; i < count && is; ++i)
+    {
+        auto name = ""s, entries = std::int64_t{};
+        xson::fast::decode(is, name);
+        xson::fast::decode(is, entries);
+        auto& key = secondary_keys[name];
+        key.fields = split_fields(name);
+        for(auto j = 0ll; j < entries && is; ++j)
+        {
+            auto sk = yar::db::decode_key(is);
+            auto position = std::int64_t{};
+            xson::fast::decode(is, position);
+            key.keys.emplace_hint(key.keys.end(), std::move(sk), position);
+        }
+        key.distinct = count_distinct(key.keys);
+    }
+
+    if(is.fail())
+        return false;
+
+    m_sequence = sequence;
+    m_primary_keys = std::move(primary_keys);
+    m_secondary_keys = std::move(secondary_keys);
+    return true;
 }
@@ -0,0 +1,230 @@
+module yar;
+import :metrics;
+import std;
+
+namespace {
+
+using namespace std::string_literals;
+using namespace std::string_view_literals;
+
+constexpr auto sub_bucket_mask = (1uz << yar::db::histogram::sub_bucket_bits) - 1;
+
+constexpr auto operation_names = std::array{"read"sv, "create"sv, "update"sv, "destroy"sv};
+
+constexpr auto stage_names = std::array{"lock"sv, "plan"sv, "decode"sv, "match"sv, "filter"sv, "write"sv, "commit"sv, "index"sv};
+
+auto escape(std::string_view value)
+{
+    auto escaped = std::string{};
+    escaped.reserve(value.size());
+    for(const auto c : value)
+    {
+        if(c == '\\')     escaped += "\\\\"s;
+        else if(c == '"') escaped += "\\\""s;
+        else if(c == '\n') escaped += "\\n"s;
+        else              escaped.push_back(c);
+    }
+    return escaped;
+}
+
+} // namespace
+
+std::size_t yar::db::thread_slot()
+{
+    static auto threads = std::atomic<std::size_t>{0};
+    thread_local const auto slot = threads.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+std::chrono::nanoseconds yar::db::histogram::snapshot::quantile(double q) const
+{
+    if(count == 0)
+        return std::chrono::nanoseconds::zero();
+    const auto rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(count))));
+    auto seen = std::uint64_t{0};
+    for(auto i = 0uz; i < bucket_count; ++i)
+    {
+        seen += counts[i];
+        if(seen >= rank)
+            return bound(i);
+    }
+    return bound(bucket_count - 1);
+}
+
+void yar::db::histogram::record(std::chrono::nanoseconds value)
+{
+    auto& shard = m_shards[yar::db::thread_slot() % shard_count];
+    shard.counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(std::max(value.count(), std::int64_t{0}), std::memory_order_relaxed);
+}
+
+yar::db::histogram::snapshot yar::db::histogram::collect() const
+{
+    auto result = snapshot{};
+    for(const auto& shard : m_shards)
+    {
+        for(auto i = 0uz; i < bucket_count; ++i)
+        {
+            const auto n = shard.counts[i].load(std::memory_order_relaxed);
+            result.counts[i] += n;
+            result.count += n;
+        }
+        result.sum += std::chrono::nanoseconds{shard.sum.load(std::memory_order_relaxed)};
+    }
+    return result;
+}
+
+std::size_t yar::db::histogram::bucket(std::chrono::nanoseconds value)
+{
+    // Buckets are closed above like Prometheus buckets, so one less than the value picks the bucket
+    if(value.count() <= std::int64_t{1} << lowest_exponent)
+        return 0;
+    const auto x = static_cast<std::uint64_t>(value.count() - 1);
+    const auto exponent = std::bit_width(x) - 1;
+    if(exponent >= highest_exponent)
+        return bucket_count - 1;
+    const auto sub = (x >> (exponent - sub_bucket_bits)) & sub_bucket_mask;
+    return 1 + (static_cast<std::size_t>(exponent - lowest_exponent) << sub_bucket_bits) + sub;
+}
+
+std::chrono::nanoseconds yar::db::histogram::bound(std::size_t bucket)
+{
+    if(bucket == 0)
+        return std::chrono::nanoseconds{std::int64_t{1} << lowest_exponent};
+    if(bucket >= bucket_count - 1)
+        return std::chrono::nanoseconds::max();
+    const auto exponent = lowest_exponent + static_cast<int>((bucket - 1) >> sub_bucket_bits);
+    const auto sub = static_cast<std::int64_t>((bucket - 1) & sub_bucket_mask);
+    return std::chrono::nanoseconds{(std::int64_t{1} << exponent) + ((sub + 1) << (exponent - sub_bucket_bits))};
+}
+
+void yar::db::counter::add(std::uint64_t n)
+{
+    m_shards[yar::db::thread_slot() % shard_count].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+std::uint64_t yar::db::counter::value() const
+{
+    auto result = std::uint64_t{0};
+    for(const auto& shard : m_shards)
+        result += shard.value.load(std::memory_order_relaxed);
+    return result;
+}
+
+void yar::db::exposition::family(std::string_view name, std::string_view type, std::string_view help)
+{
+    m_text += std::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+void yar::db::exposition::sample(std::string_view name, label_set labels, double value)
+{
+    write(name, labels, {}, std::format("{}", value));
+}
+
+void yar::db::exposition::sample(std::string_view name, label_set labels, const yar::db::histogram::snapshot& counts)
+{
+    // Only the bounds at powers of two are written, they are exact bucket bounds
+    const auto buckets = std::string{name} + "_bucket"s;
+    auto cumulative = std::uint64_t{0};
+    for(auto i = 0uz; i < yar::db::histogram::bucket_count - 1; ++i)
+    {
+        cumulative += counts.counts[i];
+        if(i == 0 || ((i - 1) & sub_bucket_mask) == sub_bucket_mask)
+        {
+            const auto seconds = std::chrono::duration<double>{yar::db::histogram::bound(i)}.count();
+            write(buckets, labels, std::format("{}", seconds), std::format("{}", cumulative));
+        }
+    }
+    write(buckets, labels, "+Inf"sv, std::format("{}", counts.count));
+    write(std::string{name} + "_sum"s, labels, {}, std::format("{}", std::chrono::duration<double>{counts.sum}.count()));
+    write(std::string{name} + "_count"s, labels, {}, std::format("{}", counts.count));
+}
+
+void yar::db::exposition::write(std::string_view name, label_set labels, std::string_view le, std::string_view value)
+{
+    m_text += name;
+    if(labels.size() > 0 || !le.empty())
+    {
+        auto separator = '{';
+        for(const auto& [label, text] : labels)
+        {
+            m_text += std::format("{}{}=\"{}\"", separator, label, escape(text));
+            separator = ',';
+        }
+        if(!le.empty())
+            m_text += std::format("{}le=\"{}\"", separator, le);
+        m_text += '}';
+    }
+    m_text += std::format(" {}\n", value);
+}
+
+yar::db::collection_metrics& yar::db::metrics::collection(std::string_view name)
+{
+    {
+        const auto guard = std::shared_lock{m_mutex};
+        if(const auto it = m_collections.find(name); it != m_collections.end())
+            return *it->second;
+    }
+    const auto guard = std::unique_lock{m_mutex};
+    auto& counters = m_collections[std::string{name}];
+    if(!counters)
+        counters = std::make_unique<yar::db::collection_metrics>(*this);
+    return *counters;
+}
+
+void yar::db::metrics::expose(yar::db::exposition& out) const
+{
+    out.family("yardb_engine_operation_seconds"sv, "histogram"sv, "Latency of engine operations"sv);
+    for(auto op = 0uz; op < operation_count; ++op)
+        if(const auto snapshot = m_operations[op].collect(); snapshot.count > 0)
+            out.sample("yardb_engine_operation_seconds"sv, {{"operation"sv, operation_names[op]}}, snapshot);
+
+    out.family("yardb_engine_stage_seconds"sv, "histogram"sv, "Latency of the stages of engine operations"sv);
+    for(auto op = 0uz; op < operation_count; ++op)
+        for(auto s = 0uz; s < stage_count; ++s)
+            if(const auto snapshot = m_stages[op][s].collect(); snapshot.count > 0)
+                out.sample("yardb_engine_stage_seconds"sv, {{"operation"sv, operation_names[op]}, {"stage"sv, stage_names[s]}}, snapshot);
+
+    const auto guard = std::shared_lock{m_mutex};
+    const auto counters = std::array<std::tuple<std::string_view, std::string_view, yar::db::counter yar::db::collection_metrics::*>, 4>{{
+        {"yardb_collection_queries_total"sv, "Queries run against the collection"sv, &yar::db::collection_metrics::queries},
+        {"yardb_collection_scanned_total"sv, "Documents decoded by queries"sv, &yar::db::collection_metrics::scanned},
+        {"yardb_collection_matched_total"sv, "Documents passing the query predicates"sv, &yar::db::collection_metrics::matched},
+        {"yardb_collection_returned_total"sv, "Documents returned by queries"sv, &yar::db::collection_metrics::returned}
+    }};
+    for(const auto& [metric, help, member] : counters)
+    {
+        out.family(metric, "counter"sv, help);
+        for(const auto& [collection, queries] : m_collections)
+            out.sample(metric, {{"collection"sv, collection}}, static_cast<double>(((*queries).*member).value()));
+    }
+
+    out.family("yardb_collection_scanned_per_returned"sv, "gauge"sv, "Documents decoded per document returned"sv);
+    for(const auto& [collection, queries] : m_collections)
+        if(const auto returned = queries->returned.value(); returned > 0)
+            out.sample("yardb_collection_scanned_per_returned"sv, {{"collection"sv, collection}},
+                       static_cast<double>(queries->scanned.value()) / static_cast<double>(returned));
+}
+
+yar::db::operation_timer::operation_timer(yar::db::metrics* registry, yar::db::operation op) :
+    m_registry{registry},
+    m_operation{op}
+{}
+
+yar::db::operation_timer::~operation_timer()
+{
+    if(!m_registry)
+        return;
+    for(auto s = 0uz; s < yar::db::metrics::stage_count; ++s)
+        if(m_charged[s])
+            m_registry->latency(m_operation, static_cast<yar::db::stage>(s)).record(m_stages[s]);
+    m_registry->latency(m_operation).record(std::chrono::steady_clock::now() - m_start);
+}
+
+void yar::db::operation_timer::charge(yar::db::stage s)
+{
+    const auto now = std::chrono::steady_clock::now();
+    m_stages[std::to_underlying(s)] += now - m_last;
+    m_charged[std::to_underlying(s)] = true;
+    m_last = now;
+}
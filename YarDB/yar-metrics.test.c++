@@ -0,0 +1,141 @@
+module yar;
+import :metrics;
+import tester;
+import std;
+
+namespace yar::metrics_unit_test {
+
+using namespace std;
+using namespace std::string_literals;
+using namespace std::chrono_literals;
+
+auto test_set()
+{
+    using namespace tester::basic;
+    using namespace tester::assertions;
+
+    test_case("latency histograms, counters and Prometheus exposition, [yardb]") = []
+    {
+        section("Buckets are closed above and bounded at powers of two") = []
+        {
+            using yar::db::histogram;
+            require_eq(histogram::bucket(0ns), 0uz);
+            require_eq(histogram::bucket(1024ns), 0uz);
+            require_eq(histogram::bucket(1025ns), 1uz);
+            require_eq(histogram::bound(0), 1024ns);
+            require_eq(histogram::bound(4), 2048ns);
+            require_eq(histogram::bucket(2048ns), 4uz);
+            require_eq(histogram::bucket(2049ns), 5uz);
+            require_eq(histogram::bucket(1h), histogram::bucket_count - 1);
+
+            // Every value lies in its bucket and within a quarter of the bucket's bound
+            for(auto value : {1500ns, 37'000ns, 999'999ns, 12'345'678ns, 3s})
+            {
+                const auto bucket = histogram::bucket(value);
+                require_true(value <= histogram::bound(bucket));
+                require_true(value > histogram::bound(bucket - 1));
+                require_true(histogram::bound(bucket) - value <= histogram::bound(bucket) / 4);
+            }
+        };
+
+        section("Recording from many threads loses no counts") = []
+        {
+            auto latency = yar::db::histogram{};
+            auto requests = yar::db::counter{};
+            {
+                auto workers = vector<jthread>{};
+                for(auto t = 0; t < 8; ++t)
+                    workers.emplace_back([&]
+                    {
+                        for(auto i = 0; i < 10000; ++i)
+                        {
+                            latency.record(chrono::microseconds{i % 100 + 1});
+                            requests.add();
+                        }
+                    });
+            }
+            const auto snapshot = latency.collect();
+            require_eq(snapshot.count, uint64_t{80000});
+            require_eq(requests.value(), uint64_t{80000});
+            require_eq(snapshot.sum, chrono::nanoseconds{8 * 100 * 5050 * 1000ll});
+
+            // Uniform over 1..100 us, the median bucket bound is within a quarter of 50 us
+            const auto median = snapshot.quantile(0.5);
+            require_true(median >= 50us && median <= 63us);
+            require_true(snapshot.quantile(1.0) >= 100us);
+        };
+
+        section("Exposition writes cumulative buckets, sum and count") = []
+        {
+            auto latency = yar::db::histogram{};
+            latency.record(500ns);
+            latency.record(3us);
+            latency.record(2min);
+
+            auto out = yar::db::exposition{};
+            out.family("test_seconds"sv, "histogram"sv, "Test latency"sv);
+            out.sample("test_seconds"sv, {{"route"sv, "a\"b"sv}}, latency.collect());
+            out.family("test_total"sv, "counter"sv, "Test count"sv);
+            out.sample("test_total"sv, {}, 42.0);
+
+            const auto& text = out.str();
+            require_true(text.starts_with("# HELP test_seconds Test latency\n# TYPE test_seconds histogram\n"s));
+            require_true(text.contains("test_seconds_bucket{route=\"a\\\"b\",le=\"1.024e-06\"} 1\n"s));
+            require_true(text.contains("test_seconds_bucket{route=\"a\\\"b\",le=\"4.096e-06\"} 2\n"s));
+            require_true(text.contains("test_seconds_bucket{route=\"a\\\"b\",le=\"68.719476736\"} 2\n"s));
+            require_true(text.contains("test_seconds_bucket{route=\"a\\\"b\",le=\"+Inf\"} 3\n"s));
+            require_true(text.contains("test_seconds_count{route=\"a\\\"b\"} 3\n"s));
+            require_true(text.contains("test_total 42\n"s));
+        };
+
+        section("An operation timer records each stage once with the sum of its charges") = []
+        {
+            auto registry = yar::db::metrics{};
+            {
+                auto timer = yar::db::operation_timer{&registry, yar::db::operation::update};
+                timer.charge(yar::db::stage::decode);
+                timer.charge(yar::db::stage::match);
+                timer.charge(yar::db::stage::decode);
+            }
+            require_eq(registry.latency(yar::db::operation::update).collect().count, uint64_t{1});
+            require_eq(registry.latency(yar::db::operation::update, yar::db::stage::decode).collect().count, uint64_t{1});
+            require_eq(registry.latency(yar::db::operation::update, yar::db::stage::match).collect().count, uint64_t{1});
+            require_eq(registry.latency(yar::db::operation::update, yar::db::stage::write).collect().count, uint64_t{0});
+
+            auto out = yar::db::exposition{};
+            registry.expose(out);
+            require_true(out.str().contains("yardb_engine_stage_seconds_count{operation=\"update\",stage=\"decode\"} 1\n"s));
+            require_false(out.str().contains("stage=\"write\""s));
+        };
+    };
+
+    test_case("histogram recording cost by thread count, [benchmark]") = []
+    {
+        const auto cores = static_cast<int>(max(1u, thread::hardware_concurrency()));
+        for(auto threads : {1, 4, cores})
+        {
+            auto latency = yar::db::histogram{};
+            constexpr auto records = 1'000'000;
+            const auto start = chrono::steady_clock::now();
+            {
+                auto workers = vector<jthread>{};
+                for(auto t = 0; t < threads; ++t)
+                    workers.emplace_back([&latency]
+                    {
+                        for(auto i = 0; i < records; ++i)
+                            latency.record(chrono::nanoseconds{i});
+                    });
+            }
+            const auto elapsed = chrono::duration<double, nano>{chrono::steady_clock::now() - start};
+            clog << "Histogram benchmark threads=" << threads
+                 << " ns/record=" << elapsed.count() / records << endl;
+            require_eq(latency.collect().count, static_cast<uint64_t>(threads) * records);
+        }
+    };
+
+    return true;
+}
+
+const auto test_registrar = test_set();
+
+}
@@ -0,0 +1,193 @@
+module yar;
+import :planner;
+import :index;
+import std;
+import xson;
+
+namespace {
+
+using namespace std::string_literals;
+
+// Relative cost of decoding and matching one document versus stepping one index entry
+constexpr auto decode_cost = std::size_t{16};
+
+auto to_string(yar::db::plan::access_type access)
+{
+    switch(access)
+    {
+    case yar::db::plan::primary_scan:    return "primary_scan"s;
+    case yar::db::plan::primary_key:     return "primary_key"s;
+    case yar::db::plan::secondary_index: return "secondary_index"s;
+    case yar::db::plan::intersection:    return "intersection"s;
+    }
+    std::unreachable();
+}
+
+auto to_string(yar::db::plan::ordering_type ordering)
+{
+    switch(ordering)
+    {
+    case yar::db::plan::index_order: return "index_order"s;
+    case yar::db::plan::top_k:       return "top_k"s;
+    case yar::db::plan::sort:        return "sort"s;
+    }
+    std::unreachable();
+}
+
+auto sorted_positions(const yar::db::index_view& view)
+{
+    auto positions = std::vector<yar::db::position_type>{};
+    for(const auto position : view)
+        positions.push_back(position);
+    std::ranges::sort(positions);
+    return positions;
+}
+
+} // namespace
+
+yar::db::query yar::db::query::from(const yar::db::object& selector)
+{
+    auto result = yar::db::query{selector};
+
+    if(selector.has("$top"s))
+        result.top = selector["$top"s];
+
+    if(selector.has("$skip"s))
+        result.skip = selector["$skip"s];
+
+    if(selector.has("$orderby"s))
+        result.orderby = static_cast<std::string>(selector["$orderby"s]);
+
+    result.descending = selector.has("$desc"s);
+    return result;
+}
+
+yar::db::object yar::db::plan::describe() const
+{
+    auto used = yar::db::object{yar::db::object::array{}};
+    for(const auto& name : indexes)
+        used += yar::db::object{name};
+
+    auto considered = yar::db::object{yar::db::object::array{}};
+    for(const auto& [name, size] : candidates)
+        considered += yar::db::object{{"index"s, name}, {"estimate"s, static_cast<xson::integer_type>(size)}};
+
+    return yar::db::object{
+        {"access"s,     to_string(access)},
+        {"indexes"s,    used},
+        {"estimate"s,   static_cast<xson::integer_type>(estimate)},
+        {"ordering"s,   to_string(ordering)},
+        {"candidates"s, considered}
+    };
+}
+
+yar::db::plan yar::db::make_plan(const yar::db::index& index, const yar::db::query& query)
+{
+    auto result = yar::db::plan{};
+    const auto total = index.size();
+    const auto candidates = index.candidates(query.selector);
+
+    for(const auto& candidate : candidates)
+        result.candidates.emplace_back(candidate.name, candidate.estimate);
+
+    // Most selective access path, a primary scan if no index constrains the selector
+    const auto best = std::ranges::min_element(candidates, {}, &yar::db::index_candidate::estimate);
+    const auto best_cost = best != candidates.end() ? best->estimate : total;
+
+    // Walking an index in $orderby order can stop as soon as $skip + $top documents matched,
+    // expected to happen after (skip + top) / selectivity entries
+    const auto limit = query.top == std::numeric_limits<yar::db::sequence_type>::max()
+                     ? std::optional<std::size_t>{}
+                     : std::optional<std::size_t>{static_cast<std::size_t>(query.skip + query.top)};
+    if(!query.orderby.empty() && query.orderby != "_id"s)
+        if(auto ordered = index.ordered(query.orderby, query.selector, query.descending))
+        {
+            const auto matches = std::max(best_cost, 1uz);
+            const auto cost = limit ? std::min(ordered->estimate, (*limit * ordered->estimate + matches - 1) / matches)
+                                    : ordered->estimate;
+            if(cost <= best_cost)
+            {
+                result.access = yar::db::plan::secondary_index;
+                result.ordering = yar::db::plan::index_order;
+                result.indexes.push_back(ordered->name);
+                result.estimate = ordered->estimate;
+                result.view.emplace(ordered->view);
+                return result;
+            }
+        }
+
+    if(best == candidates.end())
+    {
+        const auto scan = query.descending ? yar::db::object{"$desc"s, true} : yar::db::object{};
+        result.access = yar::db::plan::primary_scan;
+        result.estimate = total;
+        result.view.emplace(index.view(scan));
+    }
+    else
+    {
+        result.access = best->name == "_id"s ? yar::db::plan::primary_key : yar::db::plan::secondary_index;
+        result.indexes.push_back(best->name);
+        result.estimate = best->estimate;
+
+        // Intersect further indexes while stepping through one is cheaper than the decodes it is
+        // expected to save, assuming independent predicates
+        auto positions = std::optional<std::vector<yar::db::position_type>>{};
+        auto remaining = static_cast<double>(best->estimate);
+        for(const auto& candidate : candidates)
+        {
+            if(&candidate == &*best || total == 0)
+                continue;
+            const auto selectivity = static_cast<double>(candidate.estimate) / total;
+            const auto saved = decode_cost * remaining * (1.0 - selectivity);
+            if(saved <= static_cast<double>(candidate.estimate + remaining))
+                continue;
+
+            if(!positions)
+                positions = sorted_positions(best->view);
+            const auto other = sorted_positions(candidate.view);
+            auto intersected = std::vector<yar::db::position_type>{};
+            std::ranges::set_intersection(*positions, other, std::back_inserter(intersected));
+            positions = std::move(intersected);
+            remaining *= selectivity;
+            result.indexes.push_back(candidate.name);
+        }
+
+        if(positions)
+        {
+            // Intersected positions are returned in the order of the driving index, as a single index plan returns them
+            result.access = yar::db::plan::intersection;
+            result.estimate = positions->size();
+            for(const auto position : best->view)
+                if(std::ranges::binary_search(*positions, position))
+                    result.positions.push_back(position);
+        }
+        else
+            result.view.emplace(best->view);
+    }
+
+    // Primary index order is _id order, ascending unless the scan was reversed
+    const auto id_ordered = query.orderby == "_id"s &&
+                            (result.access == yar::db::plan::primary_scan ||
+                             (result.access == yar::db::plan::primary_key && !query.descending));
+
+    if(query.orderby.empty() || id_ordered)
+        result.ordering = yar::db::plan::index_order;
+    else if(limit)
+        result.ordering = yar::db::plan::top_k;
+    else
+        result.ordering = yar::db::plan::sort;
+
+    return result;
+}
+
+yar::db::secondary_key_type yar::db::sort_key(const yar::db::object& document, const std::string& field)
+{
+    auto key = yar::db::secondary_key_type{};
+    if(!document.has(field))
+        key.push_back(xson::primitive{});
+    else if(const auto value = document[field]; value.is_object() || value.is_array())
+        key.push_back(xson::primitive{});
+    else
+        key.push_back(value);
+    return key;
+}
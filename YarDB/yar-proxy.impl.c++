@@ -0,0 +1,348 @@
+module yar;
+import :proxy;
+import std;
+import net;
+
+using namespace std::string_literals;
+using namespace std::string_view_literals;
+using namespace net;
+
+namespace {
+
+// Idle connections kept per replica, more are closed when returned
+constexpr auto pool_size = 64uz;
+
+// Answered by every yardb, used for health checks
+const auto health_check_line = "GET / HTTP/1.1"s;
+
+} // namespace
+
+int yar::proxy::message::status() const
+{
+    const auto line = std::string_view{start_line};
+    const auto space = line.find(' ');
+    if(space == line.npos)
+        return 0;
+    auto code = 0;
+    const auto digits = line.substr(space + 1, 3);
+    const auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), code);
+    return ec == std::errc{} ? code : 0;
+}
+
+bool yar::proxy::read(std::istream& is, yar::proxy::message& message, bool body)
+{
+    message = yar::proxy::message{};
+    if(!std::getline(is, message.start_line, '\r'))
+        return false;
+    is >> std::ws >> message.headers >> crlf;
+
+    const auto length = message.headers.contains("content-length")
+                      ? std::stoll(std::string{message.headers["content-length"]})
+                      : 0ll;
+    if(body && length > 0)
+    {
+        // The whole body in one read instead of byte by byte
+        message.body.resize(static_cast<std::size_t>(length));
+        is.read(message.body.data(), static_cast<std::streamsize>(length));
+    }
+    return !is.fail();
+}
+
+bool yar::proxy::write(std::ostream& os, const yar::proxy::message& message)
+{
+    os << message.start_line << crlf << message.headers << crlf;
+    os.write(message.body.data(), static_cast<std::streamsize>(message.body.size()));
+    os << std::flush;
+    return !os.fail();
+}
+
+yar::proxy::message yar::proxy::error_response(int status, std::string_view reason, std::string_view text)
+{
+    auto response = yar::proxy::message{};
+    response.start_line = std::format("HTTP/1.1 {} {}", status, reason);
+    response.body = std::format(R"({{"error":"{}","message":"{}"}})", reason, text);
+    response.headers.set("content-type"s, "application/json"s);
+    response.headers.set("content-length"s, std::to_string(response.body.size()));
+    return response;
+}
+
+yar::proxy::replica::replica(std::string url) :
+    m_url{std::move(url)}
+{
+    m_writer = std::jthread{[this](std::stop_token stop){run(stop);}};
+}
+
+yar::proxy::replica::~replica()
+{
+    m_writer = std::jthread{};
+}
+
+std::optional<yar::proxy::message> yar::proxy::replica::exchange(const yar::proxy::message& request)
+{
+    ++m_outstanding;
+
+    // A server may close an idle keep-alive connection at any time, only requests that are safe
+    // to repeat are retried on a new one
+    const auto method = request.method();
+    const auto retry = method != "POST"sv && method != "PATCH"sv;
+    auto response = std::optional<yar::proxy::message>{};
+    auto reused = false;
+    for(auto attempt = 0; attempt < 2 && !response; ++attempt)
+    {
+        auto connection = acquire(reused);
+        if(!connection)
+            break;
+        auto answer = yar::proxy::message{};
+        if(yar::proxy::write(*connection, request) && yar::proxy::read(*connection, answer, method != "HEAD"sv))
+        {
+            response = std::move(answer);
+            release(std::move(connection));
+        }
+        else if(!reused || !retry)
+            break;
+    }
+
+    if(response)
+        ++m_requests;
+    else
+    {
+        ++m_failures;
+        // A write lost on a stale pooled connection is not retried either, the replica has missed it
+        // and must not keep serving as if it had not
+        if(!reused || !retry)
+            eject();
+    }
+    --m_outstanding;
+    return response;
+}
+
+void yar::proxy::replica::enqueue(std::shared_ptr<const yar::proxy::message> request, std::shared_ptr<yar::proxy::replica::fanout> result)
+{
+    ++m_outstanding;
+    {
+        const auto lock = std::lock_guard{m_queue_mutex};
+        m_queue.push_back({std::move(request), std::move(result)});
+    }
+    m_queue_wakeup.notify_one();
+}
+
+bool yar::proxy::replica::check()
+{
+    auto request = yar::proxy::message{health_check_line};
+    request.headers.set("content-length"s, "0"s);
+    const auto response = exchange(request);
+    const auto answered = response && response->status() == 200;
+    if(!answered)
+        eject();
+    else if(!m_healthy.exchange(true))
+        slog << warning("REPLICA_READMITTED") << "Replica " << m_url << " is back " << missed()
+             << " writes behind, it serves no reads until it is resynced"
+             << std::pair{"replica"sv, m_url}
+             << std::pair{"missed_writes"sv, missed()}
+             << flush;
+    return answered;
+}
+
+void yar::proxy::replica::miss()
+{
+    ++m_missed;
+}
+
+void yar::proxy::replica::resynced()
+{
+    if(m_missed.exchange(0) > 0)
+        slog << info("REPLICA_RESYNCED") << "Replica " << m_url << " is resynced and serves reads again"
+             << std::pair{"replica"sv, m_url}
+             << flush;
+}
+
+std::unique_ptr<net::endpointstream> yar::proxy::replica::acquire(bool& reused)
+{
+    {
+        const auto lock = std::lock_guard{m_pool_mutex};
+        if(!m_pool.empty())
+        {
+            auto connection = std::move(m_pool.back());
+            m_pool.pop_back();
+            reused = true;
+            return connection;
+        }
+    }
+
+    reused = false;
+    try
+    {
+        auto connection = std::make_unique<net::endpointstream>(connect(m_url));
+        return connection->good() ? std::move(connection) : nullptr;
+    }
+    catch(const std::exception&)
+    {
+        return nullptr;
+    }
+}
+
+void yar::proxy::replica::release(std::unique_ptr<net::endpointstream> connection)
+{
+    const auto lock = std::lock_guard{m_pool_mutex};
+    if(connection->good() && m_pool.size() < pool_size)
+        m_pool.push_back(std::move(connection));
+}
+
+void yar::proxy::replica::eject()
+{
+    if(m_healthy.exchange(false))
+        slog << warning("REPLICA_EJECTED") << "Replica " << m_url << " is down"
+             << std::pair{"replica"sv, m_url}
+             << flush;
+    const auto lock = std::lock_guard{m_pool_mutex};
+    m_pool.clear();
+}
+
+void yar::proxy::replica::run(std::stop_token stop)
+{
+    // Writes already queued are sent before stopping
+    while(true)
+    {
+        auto lock = std::unique_lock{m_queue_mutex};
+        if(!m_queue_wakeup.wait(lock, stop, [this]{return !m_queue.empty();}))
+            return;
+        auto next = std::move(m_queue.front());
+        m_queue.pop_front();
+        lock.unlock();
+
+        --m_outstanding;
+        const auto response = healthy() ? exchange(*next.request) : std::nullopt;
+        {
+            const auto guard = std::lock_guard{next.result->mutex};
+            if(response && response->status() > 0 && response->status() < 500)
+            {
+                if(!next.result->response)
+                    next.result->response = *response;
+                ++next.result->acknowledged;
+            }
+            else
+            {
+                ++next.result->failed;
+                miss();
+            }
+        }
+        next.result->wakeup.notify_all();
+    }
+}
+
+yar::proxy::replica_set::replica_set(const std::vector<std::string>& urls, yar::proxy::options settings) :
+    m_options{settings}
+{
+    for(const auto& url : urls)
+        m_replicas.push_back(std::make_unique<yar::proxy::replica>(url));
+
+    if(m_options.health_interval > std::chrono::seconds::zero())
+        m_checker = std::jthread{[this](std::stop_token stop){run(stop);}};
+}
+
+yar::proxy::message yar::proxy::replica_set::forward(yar::proxy::message request)
+{
+    const auto method = request.method();
+    if(request.target().starts_with("/_proxy"sv))
+        return administer(request);
+    if(method == "GET"sv || method == "HEAD"sv)
+        return balance(request);
+    return replicate(std::move(request));
+}
+
+yar::proxy::message yar::proxy::replica_set::balance(const yar::proxy::message& request)
+{
+    // Healthy replicas from the least loaded up, ties are broken by rotating the starting point
+    // The loads keep changing, so they are read once and the snapshot is sorted
+    auto candidates = std::vector<std::pair<std::size_t, yar::proxy::replica*>>{};
+    const auto start = m_next.fetch_add(1, std::memory_order_relaxed);
+    for(auto i = 0uz; i < m_replicas.size(); ++i)
+        if(auto* replica = m_replicas[(start + i) % m_replicas.size()].get(); replica->healthy() && !replica->behind())
+            candidates.emplace_back(replica->outstanding(), replica);
+    std::ranges::stable_sort(candidates, {}, &std::pair<std::size_t, yar::proxy::replica*>::first);
+
+    for(const auto& candidate : candidates)
+        if(auto response = candidate.second->exchange(request))
+            return std::move(*response);
+
+    return yar::proxy::error_response(503, "Service Unavailable"sv, "No replica available"sv);
+}
+
+yar::proxy::message yar::proxy::replica_set::administer(const yar::proxy::message& request)
+{
+    const auto method = request.method();
+    const auto target = request.target();
+
+    // POST /_proxy/replicas/<n>/resynced
+    constexpr auto prefix = "/_proxy/replicas/"sv, suffix = "/resynced"sv;
+    if(method == "POST"sv && target.starts_with(prefix) && target.ends_with(suffix) && target.size() > prefix.size() + suffix.size())
+    {
+        const auto digits = target.substr(prefix.size(), target.size() - prefix.size() - suffix.size());
+        auto n = 0uz;
+        const auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), n);
+        if(ec != std::errc{} || ptr != digits.data() + digits.size() || n >= m_replicas.size())
+            return yar::proxy::error_response(404, "Not Found"sv, "No such replica"sv);
+        m_replicas[n]->resynced();
+    }
+    else if(method != "GET"sv || target != "/_proxy"sv)
+        return yar::proxy::error_response(404, "Not Found"sv, "Unknown proxy resource"sv);
+
+    auto body = R"({"replicas":[)"s;
+    for(auto i = 0uz; i < m_replicas.size(); ++i)
+    {
+        const auto& replica = *m_replicas[i];
+        body += std::format(R"({}{{"replica":{},"url":"{}","healthy":{},"behind":{},"missed_writes":{},"outstanding":{},"requests":{},"failures":{}}})",
+                            i > 0 ? ","sv : ""sv, i, replica.url(), replica.healthy(), replica.behind(), replica.missed(),
+                            replica.outstanding(), replica.requests(), replica.failures());
+    }
+    body += "]}"s;
+
+    auto response = yar::proxy::message{"HTTP/1.1 200 OK"s};
+    response.body = std::move(body);
+    response.headers.set("content-type"s, "application/json"s);
+    response.headers.set("content-length"s, std::to_string(response.body.size()));
+    return response;
+}
+
+yar::proxy::message yar::proxy::replica_set::replicate(yar::proxy::message request)
+{
+    // One copy of the request is shared by every replica's queue
+    const auto shared = std::make_shared<const yar::proxy::message>(std::move(request));
+    const auto result = std::make_shared<yar::proxy::replica::fanout>();
+    auto queued = 0uz, quorum = 0uz;
+    {
+        const auto lock = std::lock_guard{m_write_mutex};
+        const auto healthy = static_cast<std::size_t>(std::ranges::count_if(m_replicas, &yar::proxy::replica::healthy));
+        quorum = m_options.write_quorum == 0 ? healthy : m_options.write_quorum;
+        if(healthy == 0 || healthy < quorum)
+            return yar::proxy::error_response(503, "Service Unavailable"sv,
+                                              std::format("{} of {} replicas needed for a write are up", healthy, quorum));
+        for(auto& replica : m_replicas)
+            if(replica->healthy())
+            {
+                replica->enqueue(shared, result);
+                ++queued;
+            }
+            else
+                replica->miss();
+    }
+
+    // The rest of the replicas keep going after the client has been answered
+    auto lock = std::unique_lock{result->mutex};
+    result->wakeup.wait(lock, [&]{return result->acknowledged >= quorum || result->acknowledged + result->failed >= queued;});
+    if(result->acknowledged >= quorum)
+        return *result->response;
+
+    return yar::proxy::error_response(503, "Service Unavailable"sv,
+                                      std::format("Write acknowledged by {} of {} replicas needed", result->acknowledged, quorum));
+}
+
+void yar::proxy::replica_set::run(std::stop_token stop)
+{
+    auto wakeup = std::condition_variable_any{};
+    auto mutex = std::mutex{};
+    auto lock = std::unique_lock{mutex};
+    while(!wakeup.wait_for(lock, stop, m_options.health_interval, []{return false;}) && !stop.stop_requested())
+        for(auto& replica : m_replicas)
+            replica->check();
+}
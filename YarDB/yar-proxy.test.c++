@@ -0,0 +1,231 @@
+module yar;
+import :proxy;
+import :httpd;
+import tester;
+import std;
+import net;
+import xson;
+
+namespace yar::proxy_unit_test {
+
+using namespace std;
+using namespace std::string_literals;
+using namespace std::chrono_literals;
+using namespace net;
+using namespace xson;
+
+// Remove what a previous run of a replica left behind
+auto clean(const string& file)
+{
+    for(const auto& suffix : {""s, ".pid"s, ".idx"s, ".compact"s})
+        remove((file + suffix).c_str());
+    return file;
+}
+
+// yardb serving on loopback
+class replica_fixture
+{
+public:
+    replica_fixture(const string& f, const string& port) : file{clean(f)}, m_port{port}, server{file, m_port}
+    {
+        slog.app_name("yardb")
+            .sd_id("yardb");
+        server.start();
+        std::this_thread::sleep_for(1000ms);
+    }
+
+    ~replica_fixture()
+    {
+        server.stop();
+        clean(file);
+    }
+
+    string url() const
+    {
+        return "http://localhost:"s + m_port;
+    }
+
+private:
+    string file;
+    string m_port;
+    yar::http::rest_api_server server;
+};
+
+auto request(const string& method, const string& path, const string& body = ""s)
+{
+    auto message = yar::proxy::message{method + " "s + path + " HTTP/1.1"s};
+    message.headers.set("host"s, "localhost"s);
+    message.headers.set("content-type"s, "application/json"s);
+    message.headers.set("content-length"s, to_string(body.size()));
+    message.body = body;
+    return message;
+}
+
+// Send a request straight to a replica, bypassing the proxy
+auto direct(const string& url, const yar::proxy::message& message)
+{
+    auto stream = connect(url);
+    auto response = yar::proxy::message{};
+    yar::proxy::write(stream, message);
+    yar::proxy::read(stream, response, message.method() != "HEAD"sv);
+    return response;
+}
+
+auto test_set()
+{
+    using namespace tester::basic;
+    using namespace tester::assertions;
+
+    test_case("proxy replication and balancing, [yardb]") = []
+    {
+        auto replicas = make_shared<vector<unique_ptr<replica_fixture>>>();
+        for(auto i = 0; i < 3; ++i)
+            replicas->push_back(make_unique<replica_fixture>("./proxy_test_"s + to_string(i) + ".db"s, to_string(21130 + i)));
+
+        section("Writes reach every replica and reads spread over them") = [replicas]
+        {
+            auto proxy = yar::proxy::replica_set{{(*replicas)[0]->url(), (*replicas)[1]->url(), (*replicas)[2]->url()}};
+
+            const auto created = proxy.forward(request("POST"s, "/proxied"s, R"({"value":1})"s));
+            require_eq(created.status(), 201);
+            const auto id = to_string(static_cast<xson::integer_type>(json::parse(created.body)["_id"s]));
+
+            // Every replica answered before the write was acknowledged
+            for(const auto& replica : *replicas)
+                require_eq(direct(replica->url(), request("GET"s, "/proxied/"s + id)).status(), 200);
+
+            for(auto i = 0; i < 30; ++i)
+                require_eq(proxy.forward(request("GET"s, "/proxied/"s + id)).status(), 200);
+            for(const auto& replica : proxy.replicas())
+                require_true(replica->requests() >= 5u);
+
+            // HEAD responses carry a Content-Length but no body
+            const auto head = proxy.forward(request("HEAD"s, "/proxied/"s + id));
+            require_eq(head.status(), 200);
+            require_true(head.body.empty());
+        };
+
+        section("A write is acknowledged by the quorum while a replica is down") = [replicas]
+        {
+            const auto down = "http://localhost:21139"s;
+            auto options = yar::proxy::options{};
+            options.write_quorum = 2;
+            options.health_interval = 0s;
+            auto proxy = yar::proxy::replica_set{{(*replicas)[0]->url(), (*replicas)[1]->url(), down}, options};
+
+            // The unreachable replica fails the first write and is ejected, the write is answered without waiting for that
+            require_eq(proxy.forward(request("POST"s, "/quorum"s, R"({"value":1})"s)).status(), 201);
+            std::this_thread::sleep_for(500ms);
+            require_false(proxy.replicas()[2]->healthy());
+            require_eq(proxy.forward(request("POST"s, "/quorum"s, R"({"value":2})"s)).status(), 201);
+            require_eq(proxy.forward(request("GET"s, "/quorum"s)).status(), 200);
+
+            // Waiting for every replica cannot succeed with one of them down
+            options.write_quorum = 3;
+            auto strict = yar::proxy::replica_set{{(*replicas)[0]->url(), (*replicas)[1]->url(), down}, options};
+            require_eq(strict.forward(request("POST"s, "/quorum"s, R"({"value":3})"s)).status(), 503);
+            require_false(strict.replicas()[2]->healthy());
+            require_eq(strict.forward(request("POST"s, "/quorum"s, R"({"value":4})"s)).status(), 503);
+        };
+
+        section("Health checks eject and re-admit a replica") = []
+        {
+            auto options = yar::proxy::options{};
+            options.health_interval = 1s;
+            auto proxy = yar::proxy::replica_set{{"http://localhost:21138"s}, options};
+            require_eq(proxy.forward(request("GET"s, "/"s)).status(), 503);
+            require_false(proxy.replicas()[0]->healthy());
+
+            auto late = replica_fixture{"./proxy_late_test.db"s, "21138"s};
+            std::this_thread::sleep_for(2500ms);
+            require_true(proxy.replicas()[0]->healthy());
+            require_eq(proxy.forward(request("GET"s, "/"s)).status(), 200);
+        };
+
+        section("A re-admitted replica that missed writes serves no reads until resynced") = [replicas]
+        {
+            auto options = yar::proxy::options{};
+            options.write_quorum = 1;
+            options.health_interval = 1s;
+            auto proxy = yar::proxy::replica_set{{(*replicas)[0]->url(), "http://localhost:21137"s}, options};
+
+            const auto created = proxy.forward(request("POST"s, "/behind"s, R"({"value":1})"s));
+            require_eq(created.status(), 201);
+            const auto id = to_string(static_cast<xson::integer_type>(json::parse(created.body)["_id"s]));
+            std::this_thread::sleep_for(500ms);
+            require_true(proxy.replicas()[1]->behind());
+
+            // Back up but without the write, reads stay on the replica that has it
+            auto late = replica_fixture{"./proxy_behind_test.db"s, "21137"s};
+            std::this_thread::sleep_for(2500ms);
+            require_true(proxy.replicas()[1]->healthy());
+            require_true(proxy.replicas()[1]->behind());
+            for(auto i = 0; i < 10; ++i)
+                require_eq(proxy.forward(request("GET"s, "/behind/"s + id)).status(), 200);
+
+            const auto status = json::parse(proxy.forward(request("GET"s, "/_proxy"s)).body);
+            require_true(static_cast<bool>(status["replicas"s][1]["behind"s]));
+
+            require_eq(proxy.forward(request("POST"s, "/_proxy/replicas/1/resynced"s)).status(), 200);
+            require_false(proxy.replicas()[1]->behind());
+            require_eq(proxy.forward(request("POST"s, "/_proxy/replicas/7/resynced"s)).status(), 404);
+        };
+    };
+
+    test_case("proxy throughput over yardb replicas on loopback, [benchmark]") = []
+    {
+        auto replicas = vector<unique_ptr<replica_fixture>>{};
+        auto urls = vector<string>{};
+        for(auto i = 0; i < 3; ++i)
+        {
+            replicas.push_back(make_unique<replica_fixture>("./proxy_bench_"s + to_string(i) + ".db"s, to_string(21140 + i)));
+            urls.push_back(replicas.back()->url());
+        }
+
+        const auto cores = static_cast<int>(max(1u, thread::hardware_concurrency()));
+        for(auto quorum : {1uz, 2uz, 3uz})
+        {
+            auto options = yar::proxy::options{};
+            options.write_quorum = quorum;
+            auto proxy = yar::proxy::replica_set{urls, options};
+            const auto id = to_string(static_cast<xson::integer_type>(
+                json::parse(proxy.forward(request("POST"s, "/bench"s, R"({"value":0})"s)).body)["_id"s]));
+
+            for(auto threads : {1, 4, cores})
+            {
+                const auto run = [&](int requests, auto make)
+                {
+                    const auto start = chrono::steady_clock::now();
+                    {
+                        auto workers = vector<jthread>{};
+                        for(auto t = 0; t < threads; ++t)
+                            workers.emplace_back([&]
+                            {
+                                for(auto i = 0; i < requests; ++i)
+                                    proxy.forward(make(i));
+                            });
+                    }
+                    const auto elapsed = chrono::duration<double>{chrono::steady_clock::now() - start};
+                    return threads * requests / elapsed.count();
+                };
+
+                const auto reads = run(2000, [&id](int){return request("GET"s, "/bench/"s + id);});
+                const auto writes = run(200, [](int i){return request("POST"s, "/bench"s, R"({"value":)"s + to_string(i) + "}"s);});
+                clog << "Proxy benchmark replicas=3 quorum=" << quorum << " threads=" << threads
+                     << " reads=" << static_cast<long long>(reads) << "/s"
+                     << " writes=" << static_cast<long long>(writes) << "/s" << endl;
+                require_true(reads > 0.0);
+                require_true(writes > 0.0);
+            }
+
+            for(const auto& replica : proxy.replicas())
+                clog << "Proxy benchmark replica=" << replica->url() << " requests=" << replica->requests() << endl;
+        }
+    };
+
+    return true;
+}
+
+const auto test_registrar = test_set();
+
+}
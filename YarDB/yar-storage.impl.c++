@@ -0,0 +1,390 @@
+module;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+module yar;
+import :storage;
+import :cache;
+import :metadata;
+import std;
+import xson;
+
+namespace {
+
+using namespace std::string_literals;
+
+// Smallest read mapping, mappings grow in powers of two from here
+constexpr auto minimum_capacity = std::size_t{1} << 20;
+
+// The committer writes out and syncs at least this often while there is something to do
+constexpr auto commit_interval = std::chrono::milliseconds{10};
+
+// ...and as soon as this many bytes are buffered or written but not synced
+constexpr auto commit_bytes = std::size_t{1} << 20;
+
+// Write-only stream buffer appending to a string
+// Reports positions as log offsets so that metadata operator << records where the record will land
+class append_buffer : public std::streambuf
+{
+public:
+
+    append_buffer(std::string& bytes, yar::db::position_type base) : m_bytes{bytes}, m_base{base}
+    {}
+
+protected:
+
+    int_type overflow(int_type c) override
+    {
+        if(!traits_type::eq_int_type(c, traits_type::eof()))
+            m_bytes.push_back(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override
+    {
+        m_bytes.append(s, static_cast<std::size_t>(n));
+        return n;
+    }
+
+    pos_type seekoff(off_type offset, std::ios_base::seekdir direction, std::ios_base::openmode which) override
+    {
+        if(offset != 0 || direction != std::ios_base::cur || !(which & std::ios_base::out))
+            return pos_type(off_type(-1));
+        return pos_type(m_base + static_cast<off_type>(m_bytes.size()));
+    }
+
+private:
+
+    std::string& m_bytes;
+
+    yar::db::position_type m_base;
+};
+
+} // namespace
+
+yar::db::storage::storage(yar::db::storage&& s)
+{
+    // Stop the committer of the moved-from storage before taking over what it uses
+    s.m_committer = std::jthread{};
+    s.commit();
+
+    m_file = std::move(s.m_file);
+    m_writer = std::move(s.m_writer);
+    m_descriptor = std::exchange(s.m_descriptor, -1);
+    m_regions = std::move(s.m_regions);
+    m_region = s.m_region.exchange(nullptr);
+    m_committed = s.m_committed.exchange(0);
+    m_written = std::exchange(s.m_written, 0);
+    m_synced = std::exchange(s.m_synced, 0);
+    m_sync_error = s.m_sync_error;
+    m_cache = std::exchange(s.m_cache, std::make_unique<yar::db::document_cache>(0));
+
+    if(m_descriptor >= 0)
+        m_committer = std::jthread{[this](std::stop_token stop){run(stop);}};
+}
+
+yar::db::storage::~storage()
+{
+    // The committer writes out and syncs whatever is still buffered before it exits
+    m_committer = std::jthread{};
+
+    for(const auto& region : m_regions)
+        ::munmap(const_cast<char*>(region->data), region->capacity);
+    if(m_descriptor >= 0)
+        ::close(m_descriptor);
+}
+
+void yar::db::storage::open(std::string_view file)
+{
+    m_file = file;
+    m_writer.open(m_file, std::ios::out | std::ios::in | std::ios::binary);
+    if(!m_writer.is_open())
+        m_writer.open(m_file, std::ios::out | std::ios::in | std::ios::binary | std::ios::trunc);
+    if(!m_writer.is_open())
+        throw std::runtime_error{"Failed to open/create DB "s + m_file};
+
+    m_descriptor = ::open(m_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if(m_descriptor < 0)
+        throw std::runtime_error{"Failed to open DB "s + m_file + " for reading"s};
+
+    if(!commit())
+        throw std::runtime_error{"Failed to map DB "s + m_file};
+
+    m_synced = m_written;
+    m_committer = std::jthread{[this](std::stop_token stop){run(stop);}};
+}
+
+bool yar::db::storage::replace(std::string_view file)
+{
+    // The committer writes out and syncs whatever is still buffered before it exits
+    m_committer = std::jthread{};
+    auto replaced = false, reopened = true;
+    {
+        const auto lock = std::lock_guard{m_append_mutex};
+        replaced = std::rename(std::string{file}.c_str(), m_file.c_str()) == 0;
+        if(replaced)
+        {
+            m_writer.close();
+            for(const auto& region : m_regions)
+                ::munmap(const_cast<char*>(region->data), region->capacity);
+            m_regions.clear();
+            m_region.store(nullptr, std::memory_order_release);
+            m_committed.store(0, std::memory_order_release);
+            ::close(std::exchange(m_descriptor, -1));
+            m_buffer.clear();
+            m_written = 0;
+            m_sync_target = 0;
+            m_sync_error = false;
+            m_cache->clear();
+
+            m_writer.open(m_file, std::ios::out | std::ios::in | std::ios::binary);
+            m_descriptor = ::open(m_file.c_str(), O_RDONLY | O_CLOEXEC);
+            try
+            {
+                reopened = m_writer.is_open() && m_descriptor >= 0 && write_out();
+            }
+            catch(const std::exception&)
+            {
+                reopened = false;
+            }
+
+            // A log that cannot be reopened fails every later sync instead of leaving it waiting
+            if(reopened)
+                m_synced = m_written;
+            else
+                m_sync_error = true;
+
+            // Writers waiting for an offset of the old log are released, the new log is complete and synced
+            ++m_generation;
+            m_synced_wakeup.notify_all();
+        }
+    }
+
+    // The committer is restarted on every path, appends and syncs must never wait for a missing one
+    m_committer = std::jthread{[this](std::stop_token stop){run(stop);}};
+    if(!reopened)
+        throw std::runtime_error{"Failed to open DB "s + m_file + " after compaction"s};
+    return replaced;
+}
+
+bool yar::db::storage::append(yar::db::metadata& metadata, const yar::db::object& document)
+{
+    using xson::fson::operator <<;
+
+    const auto lock = std::lock_guard{m_append_mutex};
+    auto buffer = append_buffer{m_buffer, m_written};
+    auto os = std::ostream{&buffer};
+    os << metadata << document;
+
+    if(m_buffer.size() >= commit_bytes)
+        m_wakeup.notify_one();
+    return !os.fail();
+}
+
+bool yar::db::storage::mark(yar::db::position_type position, const yar::db::metadata& status)
+{
+    const auto lock = std::lock_guard{m_append_mutex};
+    m_cache->erase(position);
+
+    // The record may still be in the append buffer
+    if(position >= m_written)
+    {
+        auto bytes = ""s;
+        auto buffer = append_buffer{bytes, 0};
+        auto os = std::ostream{&buffer};
+        os << status;
+
+        const auto offset = static_cast<std::size_t>(position - m_written);
+        if(os.fail() || offset + bytes.size() > m_buffer.size())
+            return false;
+        std::ranges::copy(bytes, m_buffer.begin() + offset);
+        return true;
+    }
+
+    m_writer.clear();
+    m_writer.seekp(position, m_writer.beg);
+    m_writer << status;
+    return !m_writer.fail();
+}
+
+bool yar::db::storage::commit()
+{
+    const auto lock = std::lock_guard{m_append_mutex};
+    return write_out();
+}
+
+bool yar::db::storage::sync()
+{
+    auto lock = std::unique_lock{m_append_mutex};
+    if(!write_out())
+        return false;
+
+    const auto target = m_written;
+    if(m_synced >= target)
+        return true;
+
+    // Ask the committer for a sync and wait for it, writers arriving meanwhile share it
+    // The target is an offset of the current log, a replace() meanwhile ends the wait as the new log is synced
+    const auto generation = m_generation;
+    m_sync_target = std::max(m_sync_target, target);
+    m_wakeup.notify_one();
+    m_synced_wakeup.wait(lock, [this, target, generation]
+    {
+        return m_generation != generation || m_synced >= target || m_sync_error;
+    });
+    if(m_generation != generation)
+        return !m_sync_error;
+    return m_synced >= target;
+}
+
+std::size_t yar::db::storage::pending() const
+{
+    const auto lock = std::lock_guard{m_append_mutex};
+    return m_buffer.size();
+}
+
+yar::db::position_type yar::db::storage::appended() const
+{
+    const auto lock = std::lock_guard{m_append_mutex};
+    return m_written + static_cast<yar::db::position_type>(m_buffer.size());
+}
+
+bool yar::db::storage::write_out()
+{
+    if(!m_buffer.empty())
+    {
+        m_writer.clear();
+        m_writer.seekp(0, m_writer.end);
+        m_writer.write(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+        m_buffer.clear();
+    }
+
+    m_writer.flush();
+    m_writer.seekp(0, m_writer.end);
+    const auto end = static_cast<yar::db::position_type>(m_writer.tellp());
+    if(m_writer.fail() || end < 0)
+        return false;
+    m_written = end;
+
+    const auto* region = m_region.load(std::memory_order_relaxed);
+    if(end > 0 && (region == nullptr || static_cast<std::size_t>(end) > region->capacity))
+        remap(end);
+
+    // Publish the mapping before the offset so that readers never see an offset beyond it
+    m_committed.store(end, std::memory_order_release);
+
+    if(static_cast<std::size_t>(end - m_synced) >= commit_bytes)
+        m_wakeup.notify_one();
+    return true;
+}
+
+void yar::db::storage::sync_written(std::unique_lock<std::mutex>& lock)
+{
+    const auto target = m_written;
+    if(m_synced >= target || m_sync_error)
+        return;
+
+    lock.unlock();
+    const auto synced = ::fdatasync(m_descriptor) == 0;
+    lock.lock();
+
+    if(synced)
+        m_synced = std::max(m_synced, target);
+    else
+        m_sync_error = true;
+    m_synced_wakeup.notify_all();
+}
+
+void yar::db::storage::run(std::stop_token stop)
+{
+    auto lock = std::unique_lock{m_append_mutex};
+    while(!stop.stop_requested())
+    {
+        m_wakeup.wait_for(lock, stop, commit_interval, [this]
+        {
+            return m_buffer.size() >= commit_bytes || m_sync_target > m_synced ||
+                   static_cast<std::size_t>(m_written - m_synced) >= commit_bytes;
+        });
+        write_out();
+        sync_written(lock);
+    }
+
+    write_out();
+    sync_written(lock);
+}
+
+void yar::db::storage::remap(yar::db::position_type size)
+{
+    // Mapping past the end of file is fine as long as nobody touches those pages,
+    // and readers never look beyond the committed offset
+    const auto capacity = std::bit_ceil(std::max(minimum_capacity, static_cast<std::size_t>(size)));
+    auto* data = ::mmap(nullptr, capacity, PROT_READ, MAP_SHARED, m_descriptor, 0);
+    if(data == MAP_FAILED)
+        throw std::runtime_error{"Failed to map DB "s + m_file};
+
+    m_regions.push_back(std::make_unique<region>(static_cast<const char*>(data), capacity));
+    m_region.store(m_regions.back().get(), std::memory_order_release);
+}
+
+std::span<const char> yar::db::storage::committed_bytes() const
+{
+    const auto committed = m_committed.load(std::memory_order_acquire);
+    const auto* region = m_region.load(std::memory_order_acquire);
+    if(region == nullptr || committed <= 0)
+        return {};
+    return {region->data, static_cast<std::size_t>(committed)};
+}
+
+bool yar::db::storage::read(yar::db::position_type position, yar::db::metadata& metadata, yar::db::object& document) const
+{
+    auto next = yar::db::position_type{};
+    return read(position, metadata, document, next);
+}
+
+bool yar::db::storage::read(yar::db::position_type position, yar::db::metadata& metadata, yar::db::object& document, yar::db::position_type& next) const
+{
+    using xson::fson::operator >>;
+
+    // The status byte is the only part of a record that changes, so it is always taken from the log
+    if(const auto [cached, size] = m_cache->find(position); cached)
+    {
+        const auto status = this->status(position);
+        if(!status)
+            return false;
+        metadata = cached->metadata;
+        metadata.status = *status;
+        document = cached->document;
+        next = position + static_cast<yar::db::position_type>(size);
+        return true;
+    }
+
+    const auto bytes = committed_bytes();
+    if(position < 0 || static_cast<std::size_t>(position) >= bytes.size())
+        return false;
+
+    auto buffer = span_buffer{bytes.subspan(static_cast<std::size_t>(position))};
+    auto is = std::istream{&buffer};
+    is >> metadata >> document;
+    if(is.fail())
+        return false;
+    const auto size = static_cast<std::size_t>(is.tellg());
+    next = position + static_cast<yar::db::position_type>(size);
+    if(m_cache->enabled())
+        m_cache->insert(position, {metadata, document}, size);
+    return true;
+}
+
+std::optional<yar::db::metadata::action> yar::db::storage::status(yar::db::position_type position) const
+{
+    const auto bytes = committed_bytes();
+    if(position < 0 || static_cast<std::size_t>(position) >= bytes.size())
+        return std::nullopt;
+
+    auto buffer = span_buffer{bytes.subspan(static_cast<std::size_t>(position))};
+    auto is = std::istream{&buffer};
+    auto status = yar::db::metadata::action{};
+    xson::fast::decode(is, status);
+    if(is.fail())
+        return std::nullopt;
+    return status;
+}
@@ -0,0 +1,294 @@
+module yar;
+import :storage;
+import :cache;
+import :metadata;
+import tester;
+import std;
+import xson;
+
+namespace yar::storage_unit_test {
+
+using namespace std;
+using namespace xson;
+
+class fixture
+{
+public:
+    fixture(string_view f) : file{f}
+    {
+        auto fs = fstream{};
+        fs.open(file,ios::out);
+        fs.close();
+    }
+
+    ~fixture()
+    {
+        remove(file.c_str());
+    }
+private:
+    std::string file;
+};
+
+// Fill a log with n small documents and return their positions
+auto populate(yar::db::storage& storage, int n)
+{
+    auto positions = vector<yar::db::position_type>{};
+    for(auto i = 0; i < n; ++i)
+    {
+        auto metadata = yar::db::metadata{"Bench"s};
+        auto document = object{{"_id"s, xson::integer_type{i + 1}}, {"A"s, i}, {"B"s, "some text to decode"s}, {"C"s, i * 2.5}};
+        storage.append(metadata, document);
+        positions.push_back(metadata.position);
+    }
+    storage.commit();
+    return positions;
+}
+
+// Run reads from the given number of threads and return reads per second
+template<typename F>
+auto measure(int threads, int reads_per_thread, F read)
+{
+    const auto start = chrono::steady_clock::now();
+    {
+        auto workers = vector<jthread>{};
+        for(auto t = 0; t < threads; ++t)
+            workers.emplace_back([&read, t, reads_per_thread]
+            {
+                for(auto i = 0; i < reads_per_thread; ++i)
+                    read(t * 7919 + i);
+            });
+    }
+    const auto elapsed = chrono::duration<double>{chrono::steady_clock::now() - start};
+    return threads * reads_per_thread / elapsed.count();
+}
+
+auto test_set()
+{
+    using namespace tester::basic;
+    using namespace tester::assertions;
+
+    test_case("mapped storage append, commit and read, [yardb]") = []
+    {
+        const auto test_file = "./storage_test.db";
+        const auto setup = fixture{test_file};
+
+        section("ReadEmpty") = [test_file]
+        {
+            auto storage = yar::db::storage{};
+            storage.open(test_file);
+            auto metadata = yar::db::metadata{};
+            auto document = object{};
+            require_true(0 == storage.committed());
+            require_false(storage.read(0, metadata, document));
+        };
+
+        section("AppendCommitRead") = [test_file]
+        {
+            auto storage = yar::db::storage{};
+            storage.open(test_file);
+            auto metadata = yar::db::metadata{"S1"s};
+            auto document = object{{"_id"s, 1ll}, {"A"s, 1}};
+            require_true(storage.append(metadata, document));
+
+            // Committing writes out the append buffer and makes the record visible to readers
+            auto m = yar::db::metadata{};
+            auto d = object{};
+            require_true(storage.commit());
+            require_true(0u == storage.pending());
+            require_true(storage.read(metadata.position, m, d));
+            require_true(d.match(document));
+            require_true(m.collection == "S1"s);
+            require_true(m.status == yar::db::metadata::created);
+        };
+
+        section("MarkAndScan") = [test_file]
+        {
+            auto storage = yar::db::storage{};
+            storage.open(test_file);
+            const auto positions = populate(storage, 3);
+            require_true(storage.mark(positions[1], yar::db::deleted));
+            require_true(storage.commit());
+
+            auto statuses = string{};
+            storage.scan([&statuses](const yar::db::metadata& metadata, const object&)
+            {
+                statuses += static_cast<char>(metadata.status);
+            });
+            require_true(statuses.ends_with("CDC"s));
+        };
+
+        section("MarkBuffered") = [test_file]
+        {
+            auto storage = yar::db::storage{};
+            storage.open(test_file);
+            auto metadata = yar::db::metadata{"S2"s};
+            require_true(storage.append(metadata, object{{"_id"s, 1ll}}));
+
+            // Marking a record still in the append buffer patches the buffer (unless the committer got there first)
+            require_true(storage.mark(metadata.position, yar::db::deleted));
+            require_true(storage.sync());
+
+            auto m = yar::db::metadata{};
+            auto d = object{};
+            require_true(storage.read(metadata.position, m, d));
+            require_true(m.status == yar::db::metadata::deleted);
+        };
+
+        section("CachedRead") = [test_file]
+        {
+            auto storage = yar::db::storage{};
+            storage.open(test_file);
+            const auto positions = populate(storage, 3);
+
+            // The second read of a record is served from the cache and finds the same next record
+            auto m = yar::db::metadata{};
+            auto d = object{};
+            auto first = yar::db::position_type{}, second = yar::db::position_type{};
+            const auto before = storage.cache().statistics();
+            require_true(storage.read(positions[0], m, d, first));
+            require_true(storage.read(positions[0], m, d, second));
+            const auto after = storage.cache().statistics();
+            require_true(first == positions[1]);
+            require_true(second == positions[1]);
+            require_true(1u == after.hits - before.hits);
+            require_true(1u == after.misses - before.misses);
+            require_true(1 == static_cast<xson::integer_type>(d["_id"s]));
+
+            // Marking drops the record, the new status is read from the log
+            require_true(storage.mark(positions[0], yar::db::deleted));
+            require_true(storage.commit());
+            require_true(storage.read(positions[0], m, d));
+            require_true(m.status == yar::db::metadata::deleted);
+        };
+
+        section("CacheEviction") = []
+        {
+            // Sixteen shards of 1 KiB, each fits a couple of entries
+            auto cache = yar::db::document_cache{16 * 1024};
+            for(auto position = 0; position < 1000; ++position)
+                cache.insert(position, {yar::db::metadata{"C"s}, object{"A"s, position}}, 100);
+            const auto statistics = cache.statistics();
+            require_true(statistics.bytes <= statistics.capacity);
+            require_true(statistics.entries + statistics.evictions == 1000u);
+            require_true(statistics.entries > 0u);
+
+            // The most recently inserted record is still there, a lookup makes it the most recently used
+            require_true(cache.find(999).first != nullptr);
+            cache.resize(0);
+            require_true(0u == cache.statistics().entries);
+
+            // A disabled cache does not count its lookups as misses
+            const auto misses = cache.statistics().misses;
+            require_true(cache.find(999).first == nullptr);
+            require_true(misses == cache.statistics().misses);
+        };
+
+        section("GrowBeyondMapping") = []
+        {
+            const auto file = "./storage_grow_test.db";
+            const auto setup = fixture{file};
+            auto storage = yar::db::storage{};
+            storage.open(file);
+            const auto positions = populate(storage, 20000);
+            require_true(storage.committed() > (1 << 20));
+            auto metadata = yar::db::metadata{};
+            auto document = object{};
+            require_true(storage.read(positions.back(), metadata, document));
+            require_true(20000 == static_cast<xson::integer_type>(document["_id"s]));
+        };
+
+        section("SyncDuringReplace") = []
+        {
+            const auto file = "./storage_replace_test.db", compacted = "./storage_replace_test.db.compact";
+            const auto setup = fixture{file}, compacted_setup = fixture{compacted};
+            {
+                auto replacement = yar::db::storage{};
+                replacement.open(compacted);
+                populate(replacement, 1);
+                require_true(replacement.sync());
+            }
+
+            auto storage = yar::db::storage{};
+            storage.open(file);
+            populate(storage, 1000);
+
+            // Writers waiting for an offset of the old, larger log are not left waiting on the smaller new one
+            auto failures = atomic<int>{0};
+            {
+                auto writers = vector<jthread>{};
+                for(auto t = 0; t < 4; ++t)
+                    writers.emplace_back([&storage, &failures]
+                    {
+                        for(auto i = 0; i < 50; ++i)
+                        {
+                            auto metadata = yar::db::metadata{"Sync"s};
+                            auto document = object{"N"s, i};
+                            if(!storage.append(metadata, document) || !storage.sync())
+                                ++failures;
+                        }
+                    });
+                require_true(storage.replace(compacted));
+            }
+            require_eq(failures.load(), 0);
+            require_true(storage.sync());
+        };
+    };
+
+    test_case("mapped storage vs fstream multi-threaded read benchmark, [benchmark]") = []
+    {
+        const auto test_file = "./storage_bench.db";
+        const auto setup = fixture{test_file};
+        const auto documents = 10000;
+        const auto reads_per_thread = 10000;
+
+        auto storage = yar::db::storage{};
+        storage.open(test_file);
+        const auto positions = populate(storage, documents);
+
+        // The old engine read path: one shared fstream, seekg and decode under a lock
+        auto stream = fstream{test_file, ios::in | ios::binary};
+        auto stream_lock = mutex{};
+        auto fstream_read = [&](int i)
+        {
+            using xson::fson::operator >>;
+            auto metadata = yar::db::metadata{};
+            auto document = object{};
+            const auto guard = lock_guard{stream_lock};
+            stream.clear();
+            stream.seekg(positions[i % documents], stream.beg);
+            stream >> metadata >> document;
+        };
+
+        // The mapped read path: lock-free decode from the committed span, or a copy out of the document cache
+        auto mapped_read = [&](int i)
+        {
+            auto metadata = yar::db::metadata{};
+            auto document = object{};
+            storage.read(positions[i % documents], metadata, document);
+        };
+
+        const auto capacity = storage.cache().statistics().capacity;
+        const auto cores = static_cast<int>(max(1u, thread::hardware_concurrency()));
+        for(auto threads : {1, 2, 4, 8, cores})
+        {
+            const auto fstream_rate = measure(threads, reads_per_thread, fstream_read);
+            storage.cache().resize(0);
+            const auto mapped_rate = measure(threads, reads_per_thread, mapped_read);
+            storage.cache().resize(capacity);
+            const auto cached_rate = measure(threads, reads_per_thread, mapped_read);
+            clog << "Read benchmark threads=" << threads
+                 << " fstream=" << static_cast<long long>(fstream_rate) << "/s"
+                 << " mapped=" << static_cast<long long>(mapped_rate) << "/s"
+                 << " cached=" << static_cast<long long>(cached_rate) << "/s"
+                 << " speedup=" << mapped_rate / fstream_rate << endl;
+            require_true(mapped_rate > 0.0);
+            require_true(cached_rate > 0.0);
+        }
+    };
+
+    return true;
+}
+
+const auto test_registrar = test_set();
+
+}
@@ -0,0 +1,89 @@
+import yar;
+import net;
+import std;
+import xson;
+
+using namespace std;
+using namespace xson;
+using namespace utils;
+
+const auto usage = R"(yarcompact [--help] [--file=<name>] [--retain_versions=<n>] [--retain_window=<seconds>])";
+
+int main(int argc, char** argv)
+try
+{
+    const auto arguments = span(argv,argc).subspan(1);
+    auto file = "yar.db"s;
+    auto retention = yar::db::retention{};
+
+    for(const string_view option : arguments)
+    {
+        if(option == "--help")
+        {
+            clog << usage << endl;
+            return 0;
+        }
+
+        if(option.starts_with("--file="))
+        {
+            file = option.substr(string_view{"--file="}.size());
+            continue;
+        }
+
+        if(option.starts_with("--retain_versions=") || option.starts_with("--retain_window="))
+        {
+            const auto name = option.substr(0, option.find('=') + 1);
+            const auto value = yar::option_value(option, name);
+            if(!value)
+            {
+                clog << "Error: invalid value " << option << endl;
+                clog << usage << endl;
+                return 1;
+            }
+            if(name == "--retain_versions=")
+                retention.versions = *value;
+            else
+                retention.window = chrono::seconds{*value};
+            continue;
+        }
+
+        if(option.starts_with("-"))
+        {
+            clog << "Error: unknown option " << option << endl;
+            clog << usage << endl;
+            return 1;
+        }
+    }
+
+    if(!ifstream{file}.is_open())
+        throw runtime_error{"file "s + file + " not found"s};
+
+    // The engine takes the DB lock, so a running server is never compacted from under it
+    auto engine = yar::db::engine{file};
+    auto compaction = engine.prepare_compaction(retention);
+    if(!compaction || !engine.compact(*compaction))
+        throw runtime_error{"failed to compact "s + file};
+
+    clog << json::stringify(
+                    {{"file"s,         file                                                        },
+                     {"before_bytes"s, static_cast<xson::integer_type>(compaction->before())       },
+                     {"after_bytes"s,  static_cast<xson::integer_type>(compaction->after())        },
+                     {"records"s,      static_cast<xson::integer_type>(compaction->records())      },
+                     {"kept"s,         static_cast<xson::integer_type>(compaction->kept())         }})
+              << endl;
+}
+catch(const system_error& e)
+{
+    cerr << "System error with code " << e.code() << " aka " << quoted(e.what()) << endl;
+    return 1;
+}
+catch(const exception& e)
+{
+    cerr << "Exception " << quoted(e.what()) << endl;
+    return 1;
+}
+catch(...)
+{
+    cerr << "Unexpected error occurred" << endl;
+    return 1;
+}
@@ -7,7 +7,7 @@ using namespace std;
 using namespace net;
 using namespace utils;
 
-const auto usage = R"(yardb [--help] [--clog] [--slog_level=<level>] [--file=<name>] [service_or_port])";
+const auto usage = R"(yardb [--help] [--clog] [--slog_level=<level>] [--file=<name>] [--retain_versions=<n>] [--retain_window=<seconds>] [--compact_interval=<seconds>] [--cache_bytes=<n>] [service_or_port])";
 
 int main(int argc, char** argv)
 try
@@ -18,6 +18,9 @@ try
     const auto arguments = span(argv,argc).subspan(1);
     auto file = "yar.db"s;
     auto service_or_port = "2112"s;
+    auto retention = yar::db::retention{};
+    auto compact_interval = chrono::seconds::zero();
+    auto cache_bytes = optional<unsigned long>{};
     slog.app_name("yardb")
         .log_level(net::syslog::severity::debug)
         .format(net::log_format::jsonl);  // Use JSONL format by default
@@ -57,6 +60,37 @@ try
             continue;
         }
 
+        if(option.starts_with("--retain_versions=") || option.starts_with("--retain_window=") || option.starts_with("--compact_interval="))
+        {
+            const auto name = option.substr(0, option.find('=') + 1);
+            const auto value = yar::option_value(option, name);
+            if(!value)
+            {
+                clog << "Error: invalid value " << option << endl;
+                clog << usage << endl;
+                return 1;
+            }
+            if(name == "--retain_versions=")
+                retention.versions = *value;
+            else if(name == "--retain_window=")
+                retention.window = chrono::seconds{*value};
+            else
+                compact_interval = chrono::seconds{*value};
+            continue;
+        }
+
+        if(option.starts_with("--cache_bytes="))
+        {
+            cache_bytes = yar::option_value(option, "--cache_bytes="sv);
+            if(!cache_bytes)
+            {
+                clog << "Error: invalid value " << option << endl;
+                clog << usage << endl;
+                return 1;
+            }
+            continue;
+        }
+
         if(option.starts_with("-"))
         {
             clog << "Error: unknown option " << option << endl;
@@ -69,6 +103,9 @@ try
 
     slog << notice << "Starting up server" << flush;
     auto server = yar::http::rest_api_server{file, service_or_port};
+    server.configure_compaction(retention, compact_interval);
+    if(cache_bytes)
+        server.configure_cache(*cache_bytes);
     server.listen(); // Blocks forever
     slog << notice << "Shutting down server" << flush;
     return 0;
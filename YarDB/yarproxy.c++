@@ -7,91 +7,28 @@ using namespace chrono;
 using namespace utils;
 using namespace net;
 
-const auto usage = R"(yarproxy [--help] [--clog] [--slog_level=<level>] --replica=<URL> [service_or_port])";
+const auto usage = R"(yarproxy [--help] [--clog] [--slog_level=<level>] --replica=<URL> [--write_quorum=<n>] [--health_interval=<seconds>] [service_or_port])";
 
-using replica = endpointstream;
-
-using replica_set = lockable<list<replica>>;
-
-inline auto& operator >> (istream& is, ostream& os)
-{
-    auto request_line = ""s;
-    auto headers = http::headers{};
-
-    getline(is,request_line,'\r') >> ws >> headers >> crlf;
-    os << request_line << crlf << headers << crlf;
-
-    auto content_length = headers.contains("content-length") ? std::stoll(headers["content-length"]) : 0ull;
-
-    while(content_length and is and os)
-    {
-        os.put(is.get());
-        --content_length;
-    }
-
-    os << flush;
-    return is;
-}
-
-inline void handle(auto& client, auto& replicas)
+// Forward requests of one client until it disconnects
+// Replicas are only touched while a request is in flight, other clients are never blocked behind this one
+inline void handle(auto& client, yar::proxy::replica_set& replicas)
 {
     auto& [stream,endpoint,port] = client;
 
     slog << notice << "Accepted connection from " << endpoint << ":" << port << flush;
 
-    auto buffer = stringstream{};
-
-    auto request_and_response = [&buffer](replica& connection) {
-        buffer.seekg(0) >> connection;
-        connection >> buffer.seekp(0);
-        return connection.good();
-    };
-
-    auto request = [&buffer](replica& connection) {
-        buffer.seekg(0) >> connection;
-        return connection.good();
-    };
-
-    auto response = [&buffer](replica& connection) {
-        connection >> buffer.seekp(0);
-        return connection.good();
-    };
-
-    auto disconnected = [](const replica& connection) {
-        return not connection.good();
-    };
-
-    while(stream >> buffer)
-    {
-        auto method = ""s;
-        buffer.seekg(0) >> method;
-
-        if(method == "GET"s || method == "HEAD"s)
-        {
-            const auto guard = std::lock_guard{replicas};
-            [[maybe_unused]] auto r1 = ranges::any_of(replicas, request_and_response);
-            [[maybe_unused]] auto r2 = ranges::rotate(replicas, ++ranges::begin(replicas));
-        }
-        else
-        {
-            const auto guard = std::lock_guard{replicas};
-            [[maybe_unused]] auto r1 = ranges::all_of(replicas, request);
-            [[maybe_unused]] auto r2 = ranges::all_of(replicas, response);
-        }
-
-        buffer.seekg(0) >> stream;
-        buffer.seekp(0);
-    }
-
-    const auto guard = std::lock_guard{replicas};
-    replicas.remove_if(disconnected);
+    auto request = yar::proxy::message{};
+    while(yar::proxy::read(stream, request))
+        if(!yar::proxy::write(stream, replicas.forward(std::move(request))))
+            break;
 }
 
 int main(int argc, char** argv)
 try
 {
     const auto arguments = span(argv,argc).subspan(1);
-    auto replicas = replica_set{};
+    auto urls = vector<string>{};
+    auto options = yar::proxy::options{};
     auto service_or_port = "2113"s;
     slog.app_name("yarproxy")
         .log_level(net::syslog::severity::debug);
@@ -127,8 +64,24 @@ try
 
         if(option.starts_with("--replica="))
         {
-            auto replica_url = option.substr(string_view{"--replica="}.size());
-            replicas.emplace_back(connect(replica_url));
+            urls.emplace_back(option.substr(string_view{"--replica="}.size()));
+            continue;
+        }
+
+        if(option.starts_with("--write_quorum=") || option.starts_with("--health_interval="))
+        {
+            const auto name = option.substr(0, option.find('=') + 1);
+            const auto value = yar::option_value(option, name);
+            if(!value)
+            {
+                cerr << "Error: invalid value " << option << endl;
+                cerr << usage << endl;
+                return 1;
+            }
+            if(name == "--write_quorum=")
+                options.write_quorum = *value;
+            else
+                options.health_interval = chrono::seconds{*value};
             continue;
         }
 
@@ -142,12 +95,14 @@ try
         service_or_port = option;
     }
 
-    if(replicas.empty())
+    if(urls.empty() || options.write_quorum > urls.size())
     {
         cerr << usage << endl;
         return 1;
     }
 
+    auto replicas = yar::proxy::replica_set{urls, options};
+
     slog << info << "Starting up at "s << service_or_port << flush;
     auto endpoint = net::acceptor{service_or_port};
     endpoint.timeout(24h);